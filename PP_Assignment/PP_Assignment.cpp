@@ -1,9 +1,26 @@
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
 
 #include "Utils.h"
+#include "Colour.h"
 #include "CImg.h"
 
+// Headers generated by the build from my_kernels.cl and from the offline
+// compiled my_kernels.spv, e.g.
+//   clang -cl-std=CL2.0 -D WORK_GROUP_SCAN --target=spirv64 -O2 -c my_kernels.cl -o my_kernels.spv
+// The IL header defines EMBEDDED_KERNEL_IL only when the .spv exists
+#if __has_include("my_kernels_cl.h")
+#include "my_kernels_cl.h"
+#define EMBEDDED_KERNELS
+#endif
+
+#if __has_include("my_kernels_spv.h")
+#include "my_kernels_spv.h"
+#endif
+
 using namespace cimg_library;
 
 void print_help() {
@@ -16,7 +33,651 @@ void print_help() {
 	std::cerr << "  -h : print this message" << std::endl;
 	std::cerr << "  -b : custom bin size" << std::endl;
 	std::cerr << "  -m : scan method (0, Hills, 1, Blelloch)" << std::endl;
+	std::cerr << "  -r : histogram merge (0, atomic, 1, reduce)" << std::endl;
 	std::cerr << "  -o : output intermediate vectors" << std::endl;
+	std::cerr << "  -e : histogram method (0, local, 1, replicated local, 2, two-level 16-bit, 3, radix sort 16-bit, 4, sparse hash 16-bit, 5, run-aggregated 16-bit, 6, single launch 8-bit)" << std::endl;
+	std::cerr << "  -t : run benchmarks" << std::endl;
+	std::cerr << "  -w : write the output image to a PGM/PPM file instead of displaying it (batch mode: output directory)" << std::endl;
+	std::cerr << "  -i : batch mode, every PGM/PPM image in a directory or listed in a file (one path per line)" << std::endl;
+	std::cerr << "  -c : kernel binary cache directory (default: kernel_cache, none: always compile the source)" << std::endl;
+	std::cerr << "  -q : batch mode images in flight (default: 3, 1 runs the images one after another)" << std::endl;
+}
+
+// Work-group size for a kernel on the selected device, the largest multiple
+// of the preferred size the kernel supports, capped at 256
+size_t tuned_local_size(const cl::Kernel& kernel, const cl::Device& device) {
+	size_t max_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	size_t multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+	size_t local_size = min(max_size, (size_t)256);
+
+	if (local_size > multiple) {
+		local_size -= local_size % multiple;
+	}
+
+	return local_size;
+}
+
+// Bit-depth of a PNM image from the maximum value line of its header,
+// 16 for 65535 and 8 otherwise
+int image_bit_depth(const string& filename) {
+	string f;
+	fstream file;
+	file.open(filename);
+
+	for (int i = 0; i < 100 && getline(file, f); i++) {
+		if (f == to_string(255)) {
+			return 8;
+		}
+		else if (f == to_string(65535)) {
+			return 16;
+		}
+	}
+
+	return 8;
+}
+
+// Build options for a device, OpenCL 2.0 and later devices build the
+// scans with the built-in work-group collectives, older devices use the
+// hand-written loops
+string program_build_options(const cl::Device& device) {
+	int device_version = GetDeviceVersion(device);
+
+	if (device_version >= 300) {
+		return "-cl-std=CL3.0 -D WORK_GROUP_SCAN";
+	}
+	else if (device_version >= 200) {
+		return "-cl-std=CL2.0 -D WORK_GROUP_SCAN";
+	}
+
+	return "";
+}
+
+// Load and build the device code. The build embeds the kernel source, and
+// SPIR-V compiled offline when there is one, so nothing is read from the
+// working directory; builds without the generated headers read
+// my_kernels.cl instead. With a cache directory the compiled binary is
+// kept on disk, keyed by the source or IL, build options, device and
+// driver, and later runs load it instead of compiling again. A binary or
+// IL the driver rejects falls back to the source. origin is set to what
+// the program was built from
+cl::Program build_program(const cl::Context& context, const cl::Device& device, const string& build_options, const string& cache_dir, string* origin = NULL) {
+	cl::Program::Sources sources;
+
+#ifdef EMBEDDED_KERNELS
+	sources.push_back((const char*)KernelSource);
+#else
+	AddSources(sources, "my_kernels.cl");
+#endif
+
+	// The IL was compiled with its own options, -D and -cl-std do not
+	// apply to it. It is built for OpenCL C 2.0 with the work-group
+	// collectives, so older devices with cl_khr_il_program use the source
+	bool use_il = false;
+	cl::Program::Sources il_key;
+
+#ifdef EMBEDDED_KERNEL_IL
+	use_il = DeviceSupportsIL(device) && GetDeviceVersion(device) >= 200;
+	il_key.push_back(string((const char*)KernelIL, sizeof(KernelIL)));
+#endif
+
+	cl::Program::Binaries binaries;
+	string cache_file;
+
+	if (!cache_dir.empty()) {
+		string key = use_il ? ProgramCacheKey(il_key, "", device) : ProgramCacheKey(sources, build_options, device);
+		cache_file = (filesystem::path(cache_dir) / (key + ".bin")).string();
+
+		if (LoadProgramBinary(cache_file, binaries)) {
+			try {
+				cl::Program program(context, { device }, binaries);
+				program.build({ device }, use_il ? "" : build_options.c_str());
+
+				if (origin) {
+					*origin = "cached binary";
+				}
+
+				return program;
+			}
+			catch (const cl::Error&) {
+				std::cout << "Cached kernel binary rejected, rebuilding" << std::endl;
+			}
+		}
+	}
+
+	cl::Program program;
+
+#ifdef EMBEDDED_KERNEL_IL
+	if (use_il) {
+		try {
+			program = CreateProgramWithIL(context, device, KernelIL, sizeof(KernelIL));
+			program.build({ device }, "");
+
+			if (origin) {
+				*origin = "embedded SPIR-V";
+			}
+		}
+		catch (const cl::Error&) {
+			std::cout << "Embedded SPIR-V rejected, building from source" << std::endl;
+			use_il = false;
+
+			if (!cache_file.empty()) {
+				cache_file = (filesystem::path(cache_dir) / (ProgramCacheKey(sources, build_options, device) + ".bin")).string();
+			}
+		}
+	}
+#endif
+
+	if (!use_il) {
+		program = cl::Program(context, sources);
+
+		// Build and debug the kernel code
+		try {
+			program.build({ device }, build_options.c_str());
+		}
+		catch (const cl::Error& err) {
+			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+			throw err;
+		}
+
+		if (origin) {
+#ifdef EMBEDDED_KERNELS
+			*origin = "embedded source";
+#else
+			*origin = "my_kernels.cl";
+#endif
+		}
+	}
+
+	// The cache is only an optimisation, a directory that cannot be
+	// created just means the next run compiles again
+	if (!cache_file.empty()) {
+		error_code ec;
+		filesystem::create_directories(cache_dir, ec);
+
+		if (!ec) {
+			SaveProgramBinary(cache_file, program);
+		}
+	}
+
+	return program;
+}
+
+// Build the device code for a run and report how it was built
+cl::Program load_program(const cl::Context& context, const cl::Device& device, const string& cache_dir) {
+	string build_options = program_build_options(device);
+
+	if (!build_options.empty()) {
+		std::cout << "Using work-group collective scans (" << build_options << ")" << std::endl;
+	}
+
+	string origin;
+	cl::Program program = build_program(context, device, build_options, cache_dir, &origin);
+
+	std::cout << "Kernels built from " << origin << std::endl << endl;
+
+	return program;
+}
+
+// Images for batch mode, the PGM/PPM files of a directory in name order or
+// the paths in a list file, one per line
+vector<string> list_batch_files(const string& path) {
+	vector<string> files;
+
+	if (filesystem::is_directory(path)) {
+		for (const auto& entry : filesystem::directory_iterator(path)) {
+			string extension = entry.path().extension().string();
+
+			if (entry.is_regular_file() && (extension == ".pgm" || extension == ".ppm")) {
+				files.push_back(entry.path().string());
+			}
+		}
+
+		sort(files.begin(), files.end());
+	}
+	else {
+		string line;
+		ifstream list(path);
+
+		while (getline(list, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+
+			if (!line.empty()) {
+				files.push_back(line);
+			}
+		}
+	}
+
+	return files;
+}
+
+// One in-flight image of the batch pipeline, the host image, the device
+// buffers and kernels bound to them, and the events of each stage
+struct BatchSlot {
+	string filename;
+	CImg<unsigned char> image;
+	CImg<unsigned short> image_16;
+	bool bit_16 = false;
+	bool colour = false;
+	bool busy = false;
+	int input_elements = 0;
+	size_t input_size = 0;
+	size_t image_capacity = 0;
+	chrono::steady_clock::time_point start;
+
+	cl::Buffer buffer_IN;
+	cl::Buffer buffer_OUT;
+	cl::Buffer buffer_H;
+	cl::Buffer buffer_C;
+	cl::Buffer buffer_LUT;
+	cl::Buffer buffer_BLOCK_SUMS;
+
+	// Pinned host staging for the transfers, mapped for the slot's
+	// lifetime, pageable CImg memory would make the driver stage (and
+	// often serialise) the non-blocking copies itself
+	cl::Buffer buffer_PINNED_IN;
+	cl::Buffer buffer_PINNED_OUT;
+	void* pinned_in = NULL;
+	void* pinned_out = NULL;
+
+	cl::Kernel hist_8;
+	cl::Kernel hist_rgb;
+	cl::Kernel scan_norm;
+	cl::Kernel apply_8;
+	cl::Kernel apply_rgb;
+	cl::Kernel hist_16;
+	cl::Kernel scan_blocks;
+	cl::Kernel scan_block_sums;
+	cl::Kernel scan_add_offsets;
+	cl::Kernel norm_16;
+	cl::Kernel apply_16;
+
+	cl::Event write_event;
+	cl::Event compute_start;
+	cl::Event compute_end;
+	cl::Event read_event;
+};
+
+// Device time an event spent executing, in ns
+struct EventSpan {
+	cl_ulong start;
+	cl_ulong end;
+};
+
+EventSpan event_span(const cl::Event& first, const cl::Event& last) {
+	return { first.getProfilingInfo<CL_PROFILING_COMMAND_START>(), last.getProfilingInfo<CL_PROFILING_COMMAND_END>() };
+}
+
+// Batch mode, every image goes through the default pipeline (local
+// histogram, fused 8-bit or multi-block 16-bit scan, LUT) with one
+// context and program. Up to nr_in_flight images are on the device at a
+// time, each in its own slot of buffers and kernels, with uploads,
+// kernels and readbacks on separate queues so one image uploads while
+// another computes and a third reads back. The histogram and LUT buffers
+// are sized once for the largest bit-depth, the image buffers and their
+// pinned staging buffers only grow when a larger image arrives. Outputs go
+// to output_dir when one is given. Images that cannot be loaded or saved
+// are skipped, and the batch then returns 1 so scripts can tell
+int run_batch(const cl::Context& context, const cl::Program& program, const cl::Device& device,
+	const vector<string>& files, const string& output_dir, int custom_bins, int nr_in_flight) {
+	// Bins for each bit-depth, a custom bin size applies where it is in
+	// range, with at least two so the LUT has two levels
+	int bins_8 = (custom_bins > 0 && custom_bins <= 256) ? max(custom_bins, 2) : 256;
+	int bins_16 = (custom_bins > 0 && custom_bins <= 65536) ? max(custom_bins, 2) : 65536;
+	int chunk_bins = min((cl_ulong)bins_16, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / sizeof(int));
+	int nr_chunks = (bins_16 + chunk_bins - 1) / chunk_bins;
+	int nr_partials = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+	int partial = 0;
+	int write_cum = 0;
+	size_t hist_size = bins_16 * sizeof(int);
+
+	// Dependencies between the queues are expressed only through events
+	cl::CommandQueue write_queue(context, CL_QUEUE_PROFILING_ENABLE);
+	cl::CommandQueue compute_queue(context, CL_QUEUE_PROFILING_ENABLE);
+	cl::CommandQueue read_queue(context, CL_QUEUE_PROFILING_ENABLE);
+
+	vector<BatchSlot> slots(max(1, nr_in_flight));
+
+	for (BatchSlot& slot : slots) {
+		// Device - buffers, the histogram and cumulative histogram fit either
+		// bit-depth, the LUT holds the output value of every 16-bit input value
+		slot.buffer_H = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+		slot.buffer_C = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+		slot.buffer_LUT = cl::Buffer(context, CL_MEM_READ_WRITE, 65536 * sizeof(unsigned short));
+
+		// 8-bit kernels, the cumulative histogram stays in local memory
+		slot.hist_8 = cl::Kernel(program, "histogram_vec");
+		slot.hist_rgb = cl::Kernel(program, "histogram_rgb");
+
+		for (cl::Kernel* kernel : { &slot.hist_8, &slot.hist_rgb }) {
+			kernel->setArg(1, slot.buffer_H);
+			kernel->setArg(2, cl::Local(bins_8 * sizeof(int)));
+			kernel->setArg(3, sizeof(cl_int), &bins_8);
+			kernel->setArg(5, sizeof(cl_int), &partial);
+		}
+
+		slot.scan_norm = cl::Kernel(program, "scan_normalise");
+		slot.scan_norm.setArg(0, slot.buffer_H);
+		slot.scan_norm.setArg(1, cl::Buffer());
+		slot.scan_norm.setArg(2, slot.buffer_LUT);
+		slot.scan_norm.setArg(3, cl::Local(bins_8 * sizeof(int)));
+		slot.scan_norm.setArg(4, cl::Local(bins_8 * sizeof(int)));
+		slot.scan_norm.setArg(6, sizeof(cl_int), &bins_8);
+		slot.scan_norm.setArg(7, sizeof(cl_int), &write_cum);
+
+		slot.apply_8 = cl::Kernel(program, "apply_lut");
+		slot.apply_rgb = cl::Kernel(program, "apply_lut_rgb");
+
+		for (cl::Kernel* kernel : { &slot.apply_8, &slot.apply_rgb }) {
+			kernel->setArg(1, slot.buffer_LUT);
+			kernel->setArg(3, cl::Local(256 * sizeof(unsigned char)));
+		}
+
+		// 16-bit kernels, chunked local histogram and multi-block scan
+		slot.hist_16 = cl::Kernel(program, "histogram_16_local");
+		slot.hist_16.setArg(1, slot.buffer_H);
+		slot.hist_16.setArg(2, cl::Local(chunk_bins * sizeof(int)));
+		slot.hist_16.setArg(3, sizeof(cl_int), &bins_16);
+		slot.hist_16.setArg(4, sizeof(cl_int), &chunk_bins);
+		slot.hist_16.setArg(6, sizeof(cl_int), &partial);
+
+		slot.scan_blocks = cl::Kernel(program, "scan_blocks");
+		slot.scan_block_sums = cl::Kernel(program, "scan_single_group");
+		slot.scan_add_offsets = cl::Kernel(program, "scan_add_offsets");
+
+		slot.norm_16 = cl::Kernel(program, "normalise_16");
+		slot.norm_16.setArg(0, slot.buffer_C);
+		slot.norm_16.setArg(1, slot.buffer_LUT);
+		slot.norm_16.setArg(3, sizeof(cl_int), &bins_16);
+
+		slot.apply_16 = cl::Kernel(program, "apply_lut_16");
+		slot.apply_16.setArg(1, slot.buffer_LUT);
+	}
+
+	size_t block_size = tuned_local_size(slots[0].scan_blocks, device);
+	size_t block_sums_local = tuned_local_size(slots[0].scan_block_sums, device);
+	int nr_scan_blocks = (bins_16 + block_size - 1) / block_size;
+
+	for (BatchSlot& slot : slots) {
+		slot.buffer_BLOCK_SUMS = cl::Buffer(context, CL_MEM_READ_WRITE, nr_scan_blocks * sizeof(int));
+
+		slot.scan_blocks.setArg(0, slot.buffer_H);
+		slot.scan_blocks.setArg(1, slot.buffer_C);
+		slot.scan_blocks.setArg(2, slot.buffer_BLOCK_SUMS);
+		slot.scan_blocks.setArg(3, cl::Local(block_size * sizeof(int)));
+		slot.scan_blocks.setArg(4, cl::Local(block_size * sizeof(int)));
+		slot.scan_blocks.setArg(5, sizeof(cl_int), &bins_16);
+
+		slot.scan_block_sums.setArg(0, slot.buffer_BLOCK_SUMS);
+		slot.scan_block_sums.setArg(1, cl::Local(block_sums_local * sizeof(int)));
+		slot.scan_block_sums.setArg(2, sizeof(cl_int), &nr_scan_blocks);
+
+		slot.scan_add_offsets.setArg(0, slot.buffer_C);
+		slot.scan_add_offsets.setArg(1, slot.buffer_BLOCK_SUMS);
+		slot.scan_add_offsets.setArg(2, sizeof(cl_int), &bins_16);
+	}
+
+	size_t hist_local_8 = tuned_local_size(slots[0].hist_8, device);
+	size_t hist_local_rgb = tuned_local_size(slots[0].hist_rgb, device);
+	size_t hist_local_16 = tuned_local_size(slots[0].hist_16, device);
+	size_t map_local_8 = tuned_local_size(slots[0].apply_8, device);
+	size_t map_local_rgb = tuned_local_size(slots[0].apply_rgb, device);
+	size_t map_local_16 = tuned_local_size(slots[0].apply_16, device);
+
+	int nr_images = 0;
+	int nr_failed = 0;
+	vector<EventSpan> compute_spans;
+	vector<EventSpan> transfer_spans;
+
+	// Release a slot's pinned staging memory before it is replaced
+	auto unmap_pinned = [&](BatchSlot& slot) {
+		if (slot.pinned_in) {
+			write_queue.enqueueUnmapMemObject(slot.buffer_PINNED_IN, slot.pinned_in);
+			write_queue.enqueueUnmapMemObject(slot.buffer_PINNED_OUT, slot.pinned_out);
+			slot.pinned_in = NULL;
+			slot.pinned_out = NULL;
+		}
+	};
+
+	// Wait for an image's readback, convert and save it and record the
+	// device time of its stages
+	auto finish_image = [&](BatchSlot& slot) {
+		slot.read_event.wait();
+		slot.busy = false;
+
+		int spectrum = slot.bit_16 ? slot.image_16.spectrum() : slot.image.spectrum();
+
+		// Copy the output out of the pinned staging memory, converting 16-bit
+		// colour images back to RGB on the way
+		if (slot.bit_16 && spectrum == 3) {
+			unsigned short* rgb = slot.image_16.data();
+			size_t plane = slot.input_elements;
+
+			YCbCrtoRGB((unsigned short*)slot.pinned_out, rgb + plane, rgb + 2 * plane, rgb, rgb + plane, rgb + 2 * plane, plane);
+		}
+		else {
+			memcpy(slot.bit_16 ? (void*)slot.image_16.data() : (void*)slot.image.data(), slot.pinned_out, slot.input_size);
+		}
+
+		// The device work counts towards the transfer statistics even when
+		// the output cannot be written
+		compute_spans.push_back(event_span(slot.compute_start, slot.compute_end));
+		transfer_spans.push_back(event_span(slot.write_event, slot.write_event));
+		transfer_spans.push_back(event_span(slot.read_event, slot.read_event));
+
+		if (!output_dir.empty()) {
+			string output_filename = (filesystem::path(output_dir) / filesystem::path(slot.filename).filename()).string();
+
+			try {
+				if (slot.bit_16) {
+					slot.image_16.save(output_filename.c_str());
+				}
+				else {
+					slot.image.save(output_filename.c_str());
+				}
+			}
+			catch (const cimg_library::CImgException& err) {
+				std::cerr << slot.filename << ", skipped: " << err.what() << std::endl;
+				nr_failed++;
+				return;
+			}
+		}
+
+		double image_us = chrono::duration<double, micro>(chrono::steady_clock::now() - slot.start).count();
+		EventSpan device_span = event_span(slot.write_event, slot.read_event);
+		nr_images++;
+
+		int width = slot.bit_16 ? slot.image_16.width() : slot.image.width();
+		int height = slot.bit_16 ? slot.image_16.height() : slot.image.height();
+
+		cout << slot.filename << ", " << width << "x" << height << ", " << (slot.bit_16 ? "16-bit" : "8-bit") << (spectrum == 3 ? " colour" : "") << ": "
+			<< image_us << " [us], device " << (device_span.end - device_span.start) / 1000 << " [us], " << 1e6 / image_us << " images/s" << endl;
+	};
+
+	// Outputs go into the directory, created here if it does not exist
+	if (!output_dir.empty()) {
+		error_code ec;
+		filesystem::create_directories(output_dir, ec);
+
+		if (ec) {
+			std::cerr << "Cannot create output directory " << output_dir << ": " << ec.message() << std::endl;
+		}
+	}
+
+	auto batch_start = chrono::steady_clock::now();
+
+	for (size_t i = 0; i < files.size(); i++) {
+		BatchSlot& slot = slots[i % slots.size()];
+
+		// The slot's buffers are free again once its last image is read back
+		if (slot.busy) {
+			finish_image(slot);
+		}
+
+		slot.filename = files[i];
+		slot.start = chrono::steady_clock::now();
+
+		try {
+			slot.bit_16 = image_bit_depth(slot.filename) == 16;
+
+			if (slot.bit_16) {
+				slot.image_16.load(slot.filename.c_str());
+				slot.image.assign();
+			}
+			else {
+				slot.image.load(slot.filename.c_str());
+				slot.image_16.assign();
+			}
+		}
+		catch (const cimg_library::CImgException& err) {
+			std::cerr << slot.filename << ", skipped: " << err.what() << std::endl;
+			nr_failed++;
+			continue;
+		}
+
+		int spectrum = slot.bit_16 ? slot.image_16.spectrum() : slot.image.spectrum();
+		int input_elements = slot.bit_16 ? (int)(slot.image_16.size() / spectrum) : (int)(slot.image.size() / spectrum);
+
+		// 8-bit colour images go to the device as RGB, 16-bit colour
+		// images as the Y plane of the YCbCr conversion
+		slot.colour = !slot.bit_16 && spectrum == 3;
+		slot.input_elements = input_elements;
+		slot.input_size = slot.bit_16 ? input_elements * sizeof(unsigned short) : (slot.colour ? 3 * (size_t)input_elements : input_elements);
+
+		if (slot.input_size > slot.image_capacity) {
+			unmap_pinned(slot);
+
+			slot.buffer_IN = cl::Buffer(context, CL_MEM_READ_ONLY, slot.input_size);
+			slot.buffer_OUT = cl::Buffer(context, CL_MEM_READ_WRITE, slot.input_size);
+			slot.buffer_PINNED_IN = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, slot.input_size);
+			slot.buffer_PINNED_OUT = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, slot.input_size);
+			slot.pinned_in = write_queue.enqueueMapBuffer(slot.buffer_PINNED_IN, CL_TRUE, CL_MAP_WRITE, 0, slot.input_size);
+			slot.pinned_out = write_queue.enqueueMapBuffer(slot.buffer_PINNED_OUT, CL_TRUE, CL_MAP_READ, 0, slot.input_size);
+			slot.image_capacity = slot.input_size;
+		}
+
+		// The image goes into the slot's pinned staging memory, 16-bit
+		// colour images have their Y plane converted straight into it
+		if (slot.bit_16 && spectrum == 3) {
+			unsigned short* rgb = slot.image_16.data();
+			size_t plane = input_elements;
+
+			RGBtoYCbCr(rgb, rgb + plane, rgb + 2 * plane, (unsigned short*)slot.pinned_in, rgb + plane, rgb + 2 * plane, plane);
+		}
+		else {
+			memcpy(slot.pinned_in, slot.bit_16 ? (void*)slot.image_16.data() : (void*)slot.image.data(), slot.input_size);
+		}
+
+		write_queue.enqueueWriteBuffer(slot.buffer_IN, CL_FALSE, 0, slot.input_size, slot.pinned_in, NULL, &slot.write_event);
+
+		// The kernels of an image start once its upload has finished, so
+		// its compute span does not include its own transfer
+		vector<cl::Event> after_write{ slot.write_event };
+
+		compute_queue.enqueueFillBuffer(slot.buffer_H, 0, 0, hist_size, &after_write, &slot.compute_start);
+
+		if (slot.bit_16) {
+			slot.hist_16.setArg(0, slot.buffer_IN);
+			slot.hist_16.setArg(5, sizeof(cl_int), &input_elements);
+			slot.norm_16.setArg(2, sizeof(cl_int), &input_elements);
+			slot.apply_16.setArg(0, slot.buffer_IN);
+			slot.apply_16.setArg(2, slot.buffer_OUT);
+			slot.apply_16.setArg(3, sizeof(cl_int), &input_elements);
+
+			compute_queue.enqueueNDRangeKernel(slot.hist_16, cl::NullRange, cl::NDRange(nr_partials * hist_local_16, nr_chunks), cl::NDRange(hist_local_16, 1));
+			compute_queue.enqueueNDRangeKernel(slot.scan_blocks, cl::NullRange, cl::NDRange(nr_scan_blocks * block_size), cl::NDRange(block_size));
+			compute_queue.enqueueNDRangeKernel(slot.scan_block_sums, cl::NullRange, cl::NDRange(block_sums_local), cl::NDRange(block_sums_local));
+			compute_queue.enqueueNDRangeKernel(slot.scan_add_offsets, cl::NullRange, cl::NDRange(nr_scan_blocks * block_size), cl::NDRange(block_size));
+			compute_queue.enqueueNDRangeKernel(slot.norm_16, cl::NullRange, cl::NDRange(65536), cl::NullRange);
+			compute_queue.enqueueNDRangeKernel(slot.apply_16, cl::NullRange, cl::NDRange(nr_partials * map_local_16), cl::NDRange(map_local_16), NULL, &slot.compute_end);
+		}
+		else {
+			cl::Kernel& hist = slot.colour ? slot.hist_rgb : slot.hist_8;
+			cl::Kernel& apply = slot.colour ? slot.apply_rgb : slot.apply_8;
+			size_t hist_local = slot.colour ? hist_local_rgb : hist_local_8;
+			size_t map_local = slot.colour ? map_local_rgb : map_local_8;
+
+			hist.setArg(0, slot.buffer_IN);
+			hist.setArg(4, sizeof(cl_int), &input_elements);
+			slot.scan_norm.setArg(5, sizeof(cl_int), &input_elements);
+			apply.setArg(0, slot.buffer_IN);
+			apply.setArg(2, slot.buffer_OUT);
+			apply.setArg(4, sizeof(cl_int), &input_elements);
+
+			compute_queue.enqueueNDRangeKernel(hist, cl::NullRange, cl::NDRange(nr_partials * hist_local), cl::NDRange(hist_local));
+			compute_queue.enqueueNDRangeKernel(slot.scan_norm, cl::NullRange, cl::NDRange(bins_8), cl::NDRange(bins_8));
+			compute_queue.enqueueNDRangeKernel(apply, cl::NullRange, cl::NDRange(nr_partials * map_local), cl::NDRange(map_local), NULL, &slot.compute_end);
+		}
+
+		vector<cl::Event> after_compute{ slot.compute_end };
+
+		read_queue.enqueueReadBuffer(slot.buffer_OUT, CL_FALSE, 0, slot.input_size, slot.pinned_out, &after_compute, &slot.read_event);
+		slot.busy = true;
+
+		// Submit all three queues so the cross-queue waits can resolve
+		// while the host decodes the next image
+		write_queue.flush();
+		compute_queue.flush();
+		read_queue.flush();
+	}
+
+	// Drain the slots in submission order
+	for (size_t i = files.size(); i < files.size() + slots.size(); i++) {
+		BatchSlot& slot = slots[i % slots.size()];
+
+		if (slot.busy) {
+			finish_image(slot);
+		}
+	}
+
+	for (BatchSlot& slot : slots) {
+		unmap_pinned(slot);
+	}
+
+	write_queue.finish();
+
+	double total_us = chrono::duration<double, micro>(chrono::steady_clock::now() - batch_start).count();
+
+	cout << endl << "Batch: " << nr_images << " of " << files.size() << " images, " << slots.size() << " in flight, " << total_us << " [us]";
+
+	if (nr_images > 0) {
+		cout << ", " << total_us / nr_images << " [us] per image, " << nr_images * 1e6 / total_us << " images/s";
+	}
+
+	cout << endl;
+
+	// Transfer time hidden behind the kernels of other images, the
+	// compute spans never overlap each other as they share one queue
+	cl_ulong transfer_ns = 0;
+	cl_ulong hidden_ns = 0;
+
+	for (const EventSpan& transfer : transfer_spans) {
+		transfer_ns += transfer.end - transfer.start;
+
+		for (const EventSpan& compute : compute_spans) {
+			cl_ulong start = max(transfer.start, compute.start);
+			cl_ulong end = min(transfer.end, compute.end);
+
+			if (end > start) {
+				hidden_ns += end - start;
+			}
+		}
+	}
+
+	if (transfer_ns > 0) {
+		cout << "Transfers: " << transfer_ns / 1000 << " [us], hidden behind compute " << hidden_ns / 1000 << " [us] ("
+			<< 100.0 * hidden_ns / transfer_ns << "%)" << endl;
+	}
+
+	if (nr_failed > 0) {
+		std::cerr << nr_failed << " of " << files.size() << " images failed" << std::endl;
+		return 1;
+	}
+
+	return 0;
 }
 
 int main(int argc, char** argv) {
@@ -26,9 +687,17 @@ int main(int argc, char** argv) {
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename = "test.pgm";
+	string output_filename;
+	string batch_path;
+	int nr_in_flight = 3;
+	string cache_dir = "kernel_cache";
 	int nr_bins = 0;
 	int scan_method = 0;
+	int merge_method = 0;
 	int output = 0;
+	int hist_method = 0;
+	int benchmark = 0;
+	int exit_code = 0; // Nonzero when the output image could not be saved
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
@@ -36,85 +705,107 @@ int main(int argc, char** argv) {
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
 		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { scan_method = atoi(argv[++i]); } // Added arg for scan method
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { merge_method = atoi(argv[++i]); } // Added arg for histogram merge method
 		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { nr_bins = atoi(argv[++i]); } // Added arg for custom bin sizes
 		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output = atoi(argv[++i]); } // Added arg for custom bin sizes
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { hist_method = atoi(argv[++i]); } // Added arg for histogram method
+		else if (strcmp(argv[i], "-t") == 0) { benchmark = 1; } // Added arg for benchmarks
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; } // Added arg for headless file output
+		else if ((strcmp(argv[i], "-i") == 0) && (i < (argc - 1))) { batch_path = argv[++i]; } // Added arg for batch mode
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { cache_dir = argv[++i]; } // Added arg for the kernel binary cache
+		else if ((strcmp(argv[i], "-q") == 0) && (i < (argc - 1))) { nr_in_flight = atoi(argv[++i]); } // Added arg for images in flight
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
+	if (cache_dir == "none") {
+		cache_dir.clear();
+	}
+
 	cimg::exception_mode(0);
 
 	//detect any potential exceptions
 	try {
-		CImgDisplay disp_input;
+		// Batch mode keeps one context, program and set of buffers for all
+		// the images and never opens a display
+		if (!batch_path.empty()) {
+			vector<string> files = list_batch_files(batch_path);
 
-		// Open and read the image file header to find the bit-depth
-		// of the image
-		bool bit_16 = false;
+			cl::Context context = GetContext(platform_id, device_id);
 
-		cout << image_filename << ", ";
+			std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			std::cout << "Batch of " << files.size() << " images" << std::endl << endl;
 
-		string f;
-		fstream file;
-		file.open(image_filename);
-		for (int i = 0; i < 100; i++)
-		{
-			getline(file, f);
+			cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+			cl::Program program = load_program(context, device, cache_dir);
 
-			// 8-bit image
-			if (f == to_string(255)) {
-				disp_input = CImgDisplay(CImg<unsigned char>(image_filename.c_str()), "input");
+			return run_batch(context, program, device, files, output_filename, nr_bins, nr_in_flight);
+		}
 
-				cout << "8-bit" << ", ";
+		// With an output file there are no display windows at all
+		bool headless = !output_filename.empty();
+		CImgDisplay disp_input;
 
-				// If not custom bin size or is out of range set to 8-bit max
-				if (nr_bins <= 0 || nr_bins > 256) {
-					nr_bins = 256;
-				}
+		// Read the image file header to find the bit-depth of the image
+		bool bit_16 = image_bit_depth(image_filename) == 16;
 
-				break;
-			}
+		cout << image_filename << ", " << (bit_16 ? "16-bit" : "8-bit") << ", ";
 
-			// 16-bit image
-			else if (f == to_string(65535)) {
-				disp_input = CImgDisplay(CImg<unsigned short>(image_filename.c_str()), "input");
-				bit_16 = true;
+		// If not custom bin size or is out of range set to the bit-depth max,
+		// and the LUT needs at least two levels
+		if (bit_16 && (nr_bins <= 0 || nr_bins > 65536)) {
+			nr_bins = 65536;
+		}
+		else if (!bit_16 && (nr_bins <= 0 || nr_bins > 256)) {
+			nr_bins = 256;
+		}
+		else if (nr_bins < 2) {
+			nr_bins = 2;
+		}
 
-				cout << "16-bit" << ", ";
+		// Load input image, decoded once into an image of the matching
+		// pixel type, the other one stays empty
+		CImg<unsigned char> image_input;
+		CImg<unsigned short> image_input_16;
+		int width, height, depth, spectrum;
 
-				// If not custom bin size or is out of range set to 16-bit max
-				if (nr_bins <= 0 || nr_bins > 65536) {
-					nr_bins = 65536;
-				}
+		if (bit_16) {
+			image_input_16.load(image_filename.c_str());
 
-				break;
+			if (!headless) {
+				disp_input = CImgDisplay(image_input_16, "input");
 			}
-		}
-		
-		// Load input image
-		CImg<unsigned char> image_input(image_filename.c_str());
-		CImg<unsigned short> image_input_16(image_filename.c_str());
-		CImg<unsigned short> original;
 
-		if (bit_16) {
-			original = image_input_16;
+			width = image_input_16.width();
+			height = image_input_16.height();
+			depth = image_input_16.depth();
+			spectrum = image_input_16.spectrum();
 		}
 		else {
-			original = image_input;
-		}
-		
+			image_input.load(image_filename.c_str());
 
-		// Check to see if the image is a colour image, if so
-		// convert to YCbCr and set the luminance channel as the
-		// image input, and copy the other channel so they can be
-		// recombined later
-		CImg<unsigned char> cb;
-		CImg<unsigned char> cr;
+			if (!headless) {
+				disp_input = CImgDisplay(image_input, "input");
+			}
+
+			width = image_input.width();
+			height = image_input.height();
+			depth = image_input.depth();
+			spectrum = image_input.spectrum();
+		}
 
-		if (image_input.spectrum() == 3) {
-			cb = original.get_RGBtoYCbCr().channel(1);
-			cr = original.get_RGBtoYCbCr().channel(2);
-			image_input = image_input.get_RGBtoYCbCr();
-			image_input = image_input.channel(0);
+		// Check to see if the image is a colour image, 8-bit colour
+		// images are uploaded as RGB and the histogram and LUT kernels
+		// work on the luminance, converting on the device
+		// 16-bit colour images are converted to YCbCr in place on the host
+		// and the Y plane is uploaded, Cb and Cr are reused on the way back
+		bool colour = !bit_16 && spectrum == 3;
+		size_t plane = (size_t)width * height * depth;
+
+		if (spectrum == 3) {
+			if (bit_16) {
+				unsigned short* rgb = image_input_16.data();
+				RGBtoYCbCr(rgb, rgb + plane, rgb + 2 * plane, rgb, rgb + plane, rgb + 2 * plane, plane);
+			}
 
 			cout << "Colour, ";
 		}
@@ -124,16 +815,45 @@ int main(int argc, char** argv) {
 
 		cout << nr_bins << " bins" << endl;
 
+		if (merge_method == 1 && !(bit_16 && hist_method >= 2) && hist_method != 6) {
+			cout << "Using reduction histogram merge" << endl;
+		}
+
+		// Colour images always use the RGB histogram and the separate scan
 		if (!bit_16) {
-			if (scan_method < 1) {
-				cout << "Using Hillis-Steele scan method" << endl;
+			if (colour && (hist_method == 1 || hist_method == 6)) {
+				cout << "Histogram method " << hist_method << " ignored for colour input" << endl;
+			}
+			else if (hist_method == 1) {
+				cout << "Using replicated local histogram" << endl;
+			}
+
+			if (hist_method == 6 && !colour) {
+				cout << "Using single-launch histogram, scan and normalise" << endl;
+			}
+			else if (scan_method < 1) {
+				cout << "Using fused Hillis-Steele scan and normalise method" << endl;
 			}
 			else {
 				cout << "Using Blelloch scan method" << endl;
 			}
 		}
 		else {
-			cout << "Using atomic scan method" << endl;
+			if (hist_method == 2) {
+				cout << "Using two-level histogram and scan" << endl;
+			}
+			else if (hist_method == 3) {
+				cout << "Using radix sort histogram, multi-block scan method" << endl;
+			}
+			else if (hist_method == 4) {
+				cout << "Using sparse hash histogram and compact scan" << endl;
+			}
+			else if (hist_method == 5) {
+				cout << "Using run-aggregated histogram, multi-block scan method" << endl;
+			}
+			else {
+				cout << "Using multi-block scan method" << endl;
+			}
 		}
 
 		// Part 3 - host operations
@@ -147,26 +867,12 @@ int main(int argc, char** argv) {
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 
 		// 3.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "my_kernels.cl");
-
-		cl::Program program(context, sources);
-
-		// Build and debug the kernel code
-		try {
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		cl::Program program = load_program(context, device, cache_dir);
 
 		// Part 3 - memory allocation
 		// host - input
-		size_t input_elements = original.width() * original.height();//number of input elements
+		size_t input_elements = (size_t)width * height;//number of input elements
 		size_t input_size;
 		
 		if (bit_16) {
@@ -177,30 +883,6 @@ int main(int argc, char** argv) {
 		}
 
 		vector<int> B(nr_bins, 0);
-
-		size_t padding_size = input_elements % 32;
-
-		// if the input vector is not a multiple of the local_size
-		// insert additional neutral elements (0 for addition) so that the total will not be affected
-		/*if (padding_size) {
-			//create an extra vector with neutral values
-			std::vector<int> B_ext(32 - padding_size, -1);
-			//append that extra vector to our input
-			B.insert(B.end(), B_ext.begin(), B_ext.end());
-		}*/
-
-		//If bin size is not a multiple of 32 (preferred work group size)
-		// then pad the bin vector with -1 values
-		padding_size = nr_bins % 32;
-
-		if (padding_size) {
-			//create an extra vector with neutral values
-			std::vector<int> B_ext(32 - padding_size, -1);
-			//append that extra vector to our input
-			B.insert(B.end(), B_ext.begin(), B_ext.end());
-		}
-
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
 		
 		int group_size = B.size();
 		size_t output_size = B.size() * sizeof(int);//size in bytes
@@ -213,13 +895,108 @@ int main(int argc, char** argv) {
 		//	group_size = max_wg;
 		//}
 
+		// The 16-bit histogram is built in chunks of bins that fit in the
+		// device's local memory, one pass over the image per chunk
+		int chunk_bins = min((cl_ulong)nr_bins, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / sizeof(int));
+		int nr_chunks = (nr_bins + chunk_bins - 1) / chunk_bins;
+
+		// The two-level 16-bit histogram has one coarse bucket per high byte
+		// and refines as many occupied buckets per pass as fit in local
+		// memory next to the 256 entry slot map
+		int nr_buckets = (nr_bins + 255) / 256;
+		int buckets_per_pass = max(1, (int)min((cl_ulong)256, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (256 * sizeof(int)) - 1));
+
+		// Local hash table for the sparse 16-bit histogram, a key and a count
+		// per slot, the largest power of two that fits up to 16384 slots
+		int table_bits = 1;
+
+		while (table_bits < 14 && (2 << table_bits) * 2 * sizeof(int) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+			table_bits++;
+		}
+
+		// Pixels walked by each work-item of the run-aggregated histogram
+		int run_length = 64;
+		size_t runs_global = (input_elements + run_length - 1) / run_length;
+
+		// Number of copies for the replicated histogram, as many as fit in
+		// half the local memory (so a second work-group can share a compute
+		// unit), a power of two no larger than 32
+		int copies = 1;
+
+		while (copies < 32 && copies * 2 * (nr_bins + 1) * sizeof(int) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2) {
+			copies *= 2;
+		}
+
+		// The histogram grid is sized from the device rather than the image,
+		// a few work-groups per compute unit with each work-item striding
+		// through the image
+		int compute_units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		int nr_partials = compute_units * 4;
+
+		// With the reduction merge every histogram work-group writes its own
+		// slice of the partials buffer instead of using global atomics, the
+		// other 16-bit histograms always merge atomically
+		int partial = (merge_method == 1) && !(bit_16 && hist_method >= 2) && hist_method != 6;
+		size_t partials_size = nr_partials * nr_bins * sizeof(int);
+
+		// The LUT holds the output pixel value for every input value, the
+		// sparse 16-bit engine builds a compact LUT, one value per occupied
+		// bin, and scatters it into the dense one
+		int lut_values = bit_16 ? 65536 : 256;
+		size_t lut_size = bit_16 ? lut_values * sizeof(unsigned short) : lut_values * sizeof(unsigned char);
+
 		// Device - buffers
-		cl::Buffer buffer_A(context, CL_MEM_READ_ONLY, input_size);
+		cl::Buffer buffer_A(context, CL_MEM_READ_ONLY, colour ? 3 * input_size : input_size);
 		cl::Buffer buffer_B(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_C(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_D(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_E(context, CL_MEM_READ_WRITE, input_size);
+		cl::Buffer buffer_C;
+		cl::Buffer buffer_D(context, CL_MEM_READ_WRITE, lut_size);
+		cl::Buffer buffer_E(context, CL_MEM_READ_WRITE, colour ? 3 * input_size : input_size);
 		cl::Buffer buffer_TEMP(context, CL_MEM_WRITE_ONLY, output_size);
+		cl::Buffer buffer_SCAN_ATOMIC(context, CL_MEM_READ_WRITE, output_size);
+		cl::Buffer buffer_PARTIAL;
+
+		// The fused 8-bit scan and the single-launch kernel keep the
+		// cumulative histogram in local memory, so it only needs a buffer
+		// when it is printed with -o
+		int single_launch = !bit_16 && !colour && hist_method == 6;
+		int fused = !bit_16 && scan_method < 1 && !single_launch;
+
+		if (!(fused || single_launch) || output) {
+			buffer_C = cl::Buffer(context, CL_MEM_READ_WRITE, output_size);
+		}
+		cl::Buffer buffer_COARSE(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+		cl::Buffer buffer_BUCKETS(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+		cl::Buffer buffer_OCCUPIED(context, CL_MEM_READ_WRITE, sizeof(int));
+		cl::Buffer buffer_TICKET(context, CL_MEM_READ_WRITE, sizeof(int));
+		cl::Buffer buffer_SORT_1;
+		cl::Buffer buffer_SORT_2;
+		cl::Buffer buffer_COUNTS;
+
+		// Sparse histogram lists, compacted keys and counts plus the
+		// occupied bin count of each block of 256 bins
+		cl::Buffer buffer_KEYS;
+		cl::Buffer buffer_SPARSE;
+		cl::Buffer buffer_BLOCKS;
+		cl::Buffer buffer_ENTRIES;
+		cl::Buffer buffer_SPARSE_LUT;
+
+		if (bit_16 && hist_method == 4) {
+			buffer_KEYS = cl::Buffer(context, CL_MEM_READ_WRITE, output_size);
+			buffer_SPARSE = cl::Buffer(context, CL_MEM_READ_WRITE, output_size);
+			buffer_BLOCKS = cl::Buffer(context, CL_MEM_READ_WRITE, nr_buckets * sizeof(int));
+			buffer_ENTRIES = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+			buffer_SPARSE_LUT = cl::Buffer(context, CL_MEM_READ_WRITE, nr_bins * sizeof(unsigned short));
+		}
+
+		if (bit_16 && hist_method == 3) {
+			buffer_SORT_1 = cl::Buffer(context, CL_MEM_READ_WRITE, input_size);
+			buffer_SORT_2 = cl::Buffer(context, CL_MEM_READ_WRITE, input_size);
+			buffer_COUNTS = cl::Buffer(context, CL_MEM_READ_WRITE, 16 * nr_partials * sizeof(int));
+		}
+
+		if (partial) {
+			buffer_PARTIAL = cl::Buffer(context, CL_MEM_READ_WRITE, partials_size);
+		}
 
 		//Part 4 - device operations
 		//4.1 copy array A to and initialise other arrays on device memory
@@ -232,73 +1009,406 @@ int main(int argc, char** argv) {
 			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &image_input_16.data()[0], NULL, &im_write_prof);
 		}
 		else {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &image_input.data()[0], NULL, &im_write_prof);
+			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, colour ? 3 * input_size : input_size, &image_input.data()[0], NULL, &im_write_prof);
 		}
 		
+		// Histogram kernels accumulate into their output so zero them first
+		queue.enqueueFillBuffer(buffer_B, 0, 0, output_size);
+		queue.enqueueFillBuffer(buffer_TEMP, 0, 0, output_size);
+		queue.enqueueFillBuffer(buffer_SCAN_ATOMIC, 0, 0, output_size);
+		queue.enqueueFillBuffer(buffer_COARSE, 0, 0, 256 * sizeof(int));
+		queue.enqueueFillBuffer(buffer_TICKET, 0, 0, sizeof(int));
+
 		//queue.enqueueWriteBuffer(buffer_B, CL_TRUE, 0, output_size, &B.data()[0]);//zero B buffer on device memory
 		//queue.enqueueWriteBuffer(buffer_C, CL_TRUE, 0, output_size, &B.data()[0]);
 		//queue.enqueueWriteBuffer(buffer_D, CL_TRUE, 0, output_size, &B.data()[0]);
 
 		//4.2 Setup and execute all kernels (i.e. device code)
 		cl::Kernel kernel_1;
-		if (!bit_16) {
-			kernel_1 = cl::Kernel(program, "histogram");
+		if (colour) {
+			kernel_1 = cl::Kernel(program, "histogram_rgb");
+			kernel_1.setArg(0, buffer_A);
+			kernel_1.setArg(2, cl::Local(nr_bins * sizeof(int)));//local memory size
+			kernel_1.setArg(3, sizeof(cl_int), &nr_bins);
+			kernel_1.setArg(4, sizeof(cl_int), &input_elements);
+			kernel_1.setArg(5, sizeof(cl_int), &partial);
+		}
+		else if (!bit_16 && hist_method == 1) {
+			kernel_1 = cl::Kernel(program, "histogram_rep");
+			kernel_1.setArg(0, buffer_A);
+			kernel_1.setArg(2, cl::Local(copies * (nr_bins + 1) * sizeof(int)));//local memory size
+			kernel_1.setArg(3, sizeof(cl_int), &nr_bins);
+			kernel_1.setArg(4, sizeof(cl_int), &input_elements);
+			kernel_1.setArg(5, sizeof(cl_int), &copies);
+			kernel_1.setArg(6, sizeof(cl_int), &partial);
+		}
+		else if (!bit_16) {
+			kernel_1 = cl::Kernel(program, "histogram_vec");
 			kernel_1.setArg(0, buffer_A);
-			kernel_1.setArg(1, buffer_B);
 			kernel_1.setArg(2, cl::Local(nr_bins * sizeof(int)));//local memory size
 			kernel_1.setArg(3, sizeof(cl_int), &nr_bins);
+			kernel_1.setArg(4, sizeof(cl_int), &input_elements);
+			kernel_1.setArg(5, sizeof(cl_int), &partial);
 		}
 		else {
-			kernel_1 = cl::Kernel(program, "histogram_16");
+			kernel_1 = cl::Kernel(program, "histogram_16_local");
 			kernel_1.setArg(0, buffer_A);
+			kernel_1.setArg(2, cl::Local(chunk_bins * sizeof(int)));//local memory size
+			kernel_1.setArg(3, sizeof(cl_int), &nr_bins);
+			kernel_1.setArg(4, sizeof(cl_int), &chunk_bins);
+			kernel_1.setArg(5, sizeof(cl_int), &input_elements);
+			kernel_1.setArg(6, sizeof(cl_int), &partial);
+		}
+
+		// Histograms go to the partials buffer when they are reduced afterwards
+		if (partial) {
+			kernel_1.setArg(1, buffer_PARTIAL);
+		}
+		else {
 			kernel_1.setArg(1, buffer_B);
-			kernel_1.setArg(2, sizeof(cl_int), &nr_bins);
+		}
+
+		size_t hist_local = tuned_local_size(kernel_1, device);
+		size_t hist_global = nr_partials * hist_local;
+
+		// Two-level 16-bit histogram and its bucketed scan. The occupied
+		// buckets are listed on the device after the coarse pass, so the fine
+		// pass is sized for every bucket and the unused passes exit early
+		cl::Kernel coarse_hist;
+		cl::Kernel list_buckets;
+		cl::Kernel fine_hist;
+		cl::Kernel scan_two_level;
+		size_t list_local = 0;
+		size_t scan_two_level_local = 0;
+
+		if (bit_16 && hist_method == 2) {
+			coarse_hist = cl::Kernel(program, "histogram_16_coarse");
+			coarse_hist.setArg(0, buffer_A);
+			coarse_hist.setArg(1, buffer_COARSE);
+			coarse_hist.setArg(2, cl::Local(nr_buckets * sizeof(int)));
+			coarse_hist.setArg(3, sizeof(cl_int), &nr_bins);
+			coarse_hist.setArg(4, sizeof(cl_int), &input_elements);
+
+			list_buckets = cl::Kernel(program, "compact_buckets");
+			list_local = tuned_local_size(list_buckets, device);
+			list_buckets.setArg(0, buffer_COARSE);
+			list_buckets.setArg(1, buffer_BUCKETS);
+			list_buckets.setArg(2, buffer_OCCUPIED);
+			list_buckets.setArg(3, cl::Local(list_local * sizeof(int)));
+			list_buckets.setArg(4, cl::Local(list_local * sizeof(int)));
+			list_buckets.setArg(5, sizeof(cl_int), &nr_buckets);
+
+			fine_hist = cl::Kernel(program, "histogram_16_fine");
+			fine_hist.setArg(0, buffer_A);
+			fine_hist.setArg(1, buffer_B);
+			fine_hist.setArg(2, buffer_BUCKETS);
+			fine_hist.setArg(3, buffer_OCCUPIED);
+			fine_hist.setArg(4, cl::Local(buckets_per_pass * 256 * sizeof(int)));
+			fine_hist.setArg(5, cl::Local(256 * sizeof(int)));
+			fine_hist.setArg(6, sizeof(cl_int), &buckets_per_pass);
+			fine_hist.setArg(7, sizeof(cl_int), &nr_bins);
+			fine_hist.setArg(8, sizeof(cl_int), &input_elements);
+
+			scan_two_level = cl::Kernel(program, "scan_16_two_level");
+			scan_two_level_local = tuned_local_size(scan_two_level, device);
+			scan_two_level.setArg(0, buffer_B);
+			scan_two_level.setArg(1, buffer_COARSE);
+			scan_two_level.setArg(2, buffer_C);
+			scan_two_level.setArg(3, cl::Local(scan_two_level_local * sizeof(int)));
+			scan_two_level.setArg(4, cl::Local(scan_two_level_local * sizeof(int)));
+			scan_two_level.setArg(5, sizeof(cl_int), &nr_bins);
+		}
+
+		// Radix sort of the 16-bit pixel values, four stable passes of 4 bits
+		// ping-ponging between the sort buffers so the sorted values end up
+		// in buffer_SORT_2, followed by a run boundary histogram
+		cl::Kernel radix_count;
+		cl::Kernel radix_scan;
+		cl::Kernel radix_scatter;
+		cl::Kernel sorted_hist;
+
+		if (bit_16 && hist_method == 3) {
+			radix_count = cl::Kernel(program, "radix_count");
+			radix_count.setArg(1, buffer_COUNTS);
+			radix_count.setArg(2, cl::Local(16 * sizeof(int)));
+			radix_count.setArg(3, sizeof(cl_int), &input_elements);
+
+			radix_scan = cl::Kernel(program, "scan_single_group");
+			radix_scan.setArg(0, buffer_COUNTS);
+			radix_scan.setArg(1, cl::Local(tuned_local_size(radix_scan, device) * sizeof(int)));
+			radix_scan.setArg(2, 16 * nr_partials);
+
+			radix_scatter = cl::Kernel(program, "radix_scatter");
+			radix_scatter.setArg(2, buffer_COUNTS);
+			radix_scatter.setArg(3, cl::Local(16 * tuned_local_size(radix_scatter, device) * sizeof(int)));
+			radix_scatter.setArg(4, sizeof(cl_int), &input_elements);
+
+			sorted_hist = cl::Kernel(program, "histogram_sorted");
+			sorted_hist.setArg(0, buffer_SORT_2);
+			sorted_hist.setArg(1, buffer_B);
+			sorted_hist.setArg(2, sizeof(cl_int), &nr_bins);
+			sorted_hist.setArg(3, sizeof(cl_int), &input_elements);
+		}
+
+		// Run-aggregated 16-bit histogram, one atomic per run of equal bins
+		cl::Kernel runs_hist = cl::Kernel(program, "histogram_16_runs");
+
+		if (bit_16) {
+			runs_hist.setArg(0, buffer_A);
+			runs_hist.setArg(1, buffer_B);
+			runs_hist.setArg(2, sizeof(cl_int), &nr_bins);
+			runs_hist.setArg(3, sizeof(cl_int), &input_elements);
+			runs_hist.setArg(4, sizeof(cl_int), &run_length);
+		}
+
+		// Sparse 16-bit histogram, the occupied bins are compacted into sorted
+		// lists that the scan, normalise and LUT stages use directly. The
+		// cumulative and LUT stages reuse buffer_C and buffer_D for the
+		// compact lists
+		cl::Kernel hash_hist;
+		cl::Kernel sparse_count;
+		size_t count_local = 0;
+		size_t compact_local = 0;
+		cl::Kernel sparse_scan;
+		cl::Kernel sparse_compact;
+		cl::Kernel normalise_sparse;
+		cl::Kernel scatter_sparse;
+
+		if (bit_16 && hist_method == 4) {
+			hash_hist = cl::Kernel(program, "histogram_16_hash");
+			hash_hist.setArg(0, buffer_A);
+			hash_hist.setArg(1, buffer_B);
+			hash_hist.setArg(2, cl::Local((1 << table_bits) * sizeof(int)));
+			hash_hist.setArg(3, cl::Local((1 << table_bits) * sizeof(int)));
+			hash_hist.setArg(4, sizeof(cl_int), &table_bits);
+			hash_hist.setArg(5, sizeof(cl_int), &nr_bins);
+			hash_hist.setArg(6, sizeof(cl_int), &input_elements);
+
+			sparse_count = cl::Kernel(program, "sparse_count");
+			count_local = tuned_local_size(sparse_count, device);
+			sparse_count.setArg(0, buffer_B);
+			sparse_count.setArg(1, buffer_BLOCKS);
+			sparse_count.setArg(2, cl::Local(count_local * sizeof(int)));
+			sparse_count.setArg(3, cl::Local(count_local * sizeof(int)));
+			sparse_count.setArg(4, sizeof(cl_int), &nr_bins);
+
+			sparse_scan = cl::Kernel(program, "scan_single_group");
+			sparse_scan.setArg(1, cl::Local(tuned_local_size(sparse_scan, device) * sizeof(int)));
+
+			sparse_compact = cl::Kernel(program, "sparse_compact");
+			compact_local = tuned_local_size(sparse_compact, device);
+			sparse_compact.setArg(0, buffer_B);
+			sparse_compact.setArg(1, buffer_BLOCKS);
+			sparse_compact.setArg(2, buffer_KEYS);
+			sparse_compact.setArg(3, buffer_SPARSE);
+			sparse_compact.setArg(4, buffer_ENTRIES);
+			sparse_compact.setArg(5, cl::Local(compact_local * sizeof(int)));
+			sparse_compact.setArg(6, cl::Local(compact_local * sizeof(int)));
+			sparse_compact.setArg(7, sizeof(cl_int), &nr_bins);
+
+			normalise_sparse = cl::Kernel(program, "normalise_sparse");
+			normalise_sparse.setArg(0, buffer_SPARSE);
+			normalise_sparse.setArg(1, buffer_C);
+			normalise_sparse.setArg(2, buffer_SPARSE_LUT);
+			normalise_sparse.setArg(3, sizeof(cl_int), &input_elements);
+			normalise_sparse.setArg(4, sizeof(cl_int), &nr_bins);
+
+			scatter_sparse = cl::Kernel(program, "scatter_sparse_lut");
+			scatter_sparse.setArg(0, buffer_KEYS);
+			scatter_sparse.setArg(1, buffer_SPARSE_LUT);
+			scatter_sparse.setArg(2, buffer_D);
+			scatter_sparse.setArg(3, sizeof(cl_int), &nr_bins);
+		}
+
+		// Reduction of the partial histograms, 32 consecutive bins per
+		// work-group across and up to 8 lanes walking the partials. The lanes
+		// are a power of two within the kernel's own work-group limit, as the
+		// tree reduction over them halves each step
+		cl::Kernel reduce = cl::Kernel(program, "reduce_partials");
+
+		size_t reduce_y = 1;
+		size_t reduce_global = (nr_bins + 31) / 32 * 32;
+
+		while (reduce_y < 8 && reduce_y * 2 * 32 <= tuned_local_size(reduce, device)) {
+			reduce_y *= 2;
+		}
+
+		if (partial) {
+			reduce.setArg(0, buffer_PARTIAL);
+			reduce.setArg(1, buffer_B);
+			reduce.setArg(2, cl::Local(32 * reduce_y * sizeof(int)));
+			reduce.setArg(3, sizeof(cl_int), &nr_bins);
+			reduce.setArg(4, sizeof(cl_int), &nr_partials);
 		}
 		
 		cl::Kernel kernel_2;
 		if (!bit_16) {
 			kernel_2 = cl::Kernel(program, "scan_add");
 			kernel_2.setArg(0, buffer_B);
-			kernel_2.setArg(1, buffer_C);
+			kernel_2.setArg(1, buffer_TEMP);
 			kernel_2.setArg(2, cl::Local(nr_bins * sizeof(int)));
 			kernel_2.setArg(3, cl::Local(nr_bins * sizeof(int)));
 			kernel_2.setArg(4, sizeof(cl_int), &nr_bins);
 		}
-		else {
-			kernel_2 = cl::Kernel(program, "scan_add_atomic");
-			kernel_2.setArg(0, buffer_B);
-			kernel_2.setArg(1, buffer_C);
+
+		// Multi-block scan for the 16-bit histogram, every work-group scans
+		// one block of bins, the block totals go through a single work-group
+		// exclusive scan and are then added back to each block
+		cl::Kernel scan_blocks;
+		cl::Kernel scan_block_sums;
+		cl::Kernel scan_add_offsets;
+		cl::Buffer buffer_BLOCK_SUMS;
+		size_t block_size = 0;
+		size_t block_sums_local = 0;
+		int nr_scan_blocks = 0;
+
+		if (bit_16) {
+			scan_blocks = cl::Kernel(program, "scan_blocks");
+			block_size = tuned_local_size(scan_blocks, device);
+			nr_scan_blocks = (nr_bins + block_size - 1) / block_size;
+			buffer_BLOCK_SUMS = cl::Buffer(context, CL_MEM_READ_WRITE, nr_scan_blocks * sizeof(int));
+
+			scan_blocks.setArg(0, buffer_B);
+			scan_blocks.setArg(1, buffer_C);
+			scan_blocks.setArg(2, buffer_BLOCK_SUMS);
+			scan_blocks.setArg(3, cl::Local(block_size * sizeof(int)));
+			scan_blocks.setArg(4, cl::Local(block_size * sizeof(int)));
+			scan_blocks.setArg(5, sizeof(cl_int), &nr_bins);
+
+			scan_block_sums = cl::Kernel(program, "scan_single_group");
+			block_sums_local = tuned_local_size(scan_block_sums, device);
+			scan_block_sums.setArg(0, buffer_BLOCK_SUMS);
+			scan_block_sums.setArg(1, cl::Local(block_sums_local * sizeof(int)));
+			scan_block_sums.setArg(2, sizeof(cl_int), &nr_scan_blocks);
+
+			scan_add_offsets = cl::Kernel(program, "scan_add_offsets");
+			scan_add_offsets.setArg(0, buffer_C);
+			scan_add_offsets.setArg(1, buffer_BLOCK_SUMS);
+			scan_add_offsets.setArg(2, sizeof(cl_int), &nr_bins);
 		}
 			
 
-		cl::Kernel kernel_3 = cl::Kernel(program, "normalise");
+		// The single-launch kernel has its own work-group size, its local
+		// histogram doubles as the scan scratch so it holds at least one
+		// int per work-item
+		cl::Kernel single_lut;
+		size_t lut_local = 0;
+
+		if (single_launch) {
+			single_lut = cl::Kernel(program, "histogram_lut");
+			lut_local = tuned_local_size(single_lut, device);
+			single_lut.setArg(0, buffer_A);
+			single_lut.setArg(1, buffer_B);
+			single_lut.setArg(2, buffer_C);
+			single_lut.setArg(3, buffer_D);
+			single_lut.setArg(4, buffer_TICKET);
+			single_lut.setArg(5, cl::Local(max((size_t)nr_bins, lut_local) * sizeof(int)));
+			single_lut.setArg(6, sizeof(cl_int), &nr_bins);
+			single_lut.setArg(7, sizeof(cl_int), &input_elements);
+			single_lut.setArg(8, sizeof(cl_int), &output);
+		}
+
+		cl::Kernel scan_norm;
+		if (fused) {
+			scan_norm = cl::Kernel(program, "scan_normalise");
+			scan_norm.setArg(0, buffer_B);
+			scan_norm.setArg(1, buffer_C);
+			scan_norm.setArg(2, buffer_D);
+			scan_norm.setArg(3, cl::Local(nr_bins * sizeof(int)));
+			scan_norm.setArg(4, cl::Local(nr_bins * sizeof(int)));
+			scan_norm.setArg(5, sizeof(cl_int), &input_elements);
+			scan_norm.setArg(6, sizeof(cl_int), &nr_bins);
+			scan_norm.setArg(7, sizeof(cl_int), &output);
+		}
+
+		cl::Kernel kernel_3;
+		if (!bit_16) {
+			kernel_3 = cl::Kernel(program, "normalise");
+		}
+		else {
+			kernel_3 = cl::Kernel(program, "normalise_16");
+		}
+
 		kernel_3.setArg(0, buffer_C);
 		kernel_3.setArg(1, buffer_D);
 		kernel_3.setArg(2, sizeof(cl_int), &input_elements);
 		kernel_3.setArg(3, sizeof(cl_int), &nr_bins);
 
-
+		// The 8-bit LUT is applied 16 pixels per work-item and the 16-bit LUT
+		// 8 pixels per work-item, both grid-stride like the histogram kernels.
+		// The 16-bit LUT goes in constant memory when the device's constant
+		// buffer can hold it, otherwise through a 1D image buffer when images
+		// are supported (the spec's minimum image buffer size is 65536 pixels)
 		cl::Kernel kernel_4;
-		if (!bit_16) {
+		cl::Image1DBuffer image_LUT;
+		cl::Memory lut_memory = buffer_D;
+
+		if (colour) {
+			kernel_4 = cl::Kernel(program, "apply_lut_rgb");
+			kernel_4.setArg(3, cl::Local(256 * sizeof(unsigned char)));
+			kernel_4.setArg(4, sizeof(cl_int), &input_elements);
+		}
+		else if (!bit_16) {
 			kernel_4 = cl::Kernel(program, "apply_lut");
+			kernel_4.setArg(3, cl::Local(256 * sizeof(unsigned char)));
+			kernel_4.setArg(4, sizeof(cl_int), &input_elements);
+		}
+		else if (device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() >= lut_size) {
+			kernel_4 = cl::Kernel(program, "apply_lut_16_const");
+			kernel_4.setArg(3, sizeof(cl_int), &input_elements);
+
+			cout << "Using constant memory 16-bit LUT" << endl << endl;
+		}
+		else if (device.getInfo<CL_DEVICE_IMAGE_SUPPORT>()) {
+			image_LUT = cl::Image1DBuffer(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNSIGNED_INT16), lut_values, buffer_D);
+			lut_memory = image_LUT;
+
+			kernel_4 = cl::Kernel(program, "apply_lut_16_image");
+			kernel_4.setArg(3, sizeof(cl_int), &input_elements);
+
+			cout << "Using image 16-bit LUT" << endl << endl;
 		}
 		else {
 			kernel_4 = cl::Kernel(program, "apply_lut_16");
+			kernel_4.setArg(3, sizeof(cl_int), &input_elements);
 		}
-		
+
 		kernel_4.setArg(0, buffer_A);
-		kernel_4.setArg(1, buffer_D);
+		kernel_4.setArg(1, lut_memory);
 		kernel_4.setArg(2, buffer_E);
-		kernel_4.setArg(3, sizeof(cl_int), &nr_bins);
 
-		cl::Kernel global_hist = cl::Kernel(program, "histogram_atomic");
+		size_t map_local = tuned_local_size(kernel_4, device);
+		size_t map_global = nr_partials * map_local;
+
+		cl::Kernel global_hist;
+		if (!bit_16) {
+			global_hist = cl::Kernel(program, "histogram_atomic");
+		}
+		else {
+			global_hist = cl::Kernel(program, "histogram_16");
+		}
+
 		global_hist.setArg(0, buffer_A);
 		global_hist.setArg(1, buffer_TEMP);
 		global_hist.setArg(2, sizeof(cl_int), &nr_bins);
 
+		// One pixel per work-item version of the 8-bit histogram
+		cl::Kernel local_hist = cl::Kernel(program, "histogram");
+		local_hist.setArg(0, buffer_A);
+		local_hist.setArg(1, buffer_TEMP);
+		local_hist.setArg(2, cl::Local(nr_bins * sizeof(int)));
+		local_hist.setArg(3, sizeof(cl_int), &nr_bins);
+		local_hist.setArg(4, sizeof(cl_int), &input_elements);
+
+		// One work-item per pixel, rounded up to a whole number of work-groups
+		size_t local_hist_local = tuned_local_size(local_hist, device);
+		size_t local_hist_global = (input_elements + local_hist_local - 1) / local_hist_local * local_hist_local;
+
+		// The atomic scan accumulates into its own zeroed buffer rather than
+		// buffer_TEMP, which the comparison histograms write
 		cl::Kernel scan_add_atomic = cl::Kernel(program, "scan_add_atomic");
 		scan_add_atomic.setArg(0, buffer_B);
-		scan_add_atomic.setArg(1, buffer_TEMP);
+		scan_add_atomic.setArg(1, buffer_SCAN_ATOMIC);
 
 		cl::Kernel belloch = cl::Kernel(program, "blelloch_scan");
 		belloch.setArg(0, buffer_B);
@@ -309,83 +1419,212 @@ int main(int argc, char** argv) {
 		cl::Kernel belloch2 = cl::Kernel(program, "scan_bl");
 		belloch2.setArg(0, buffer_B);
 
+		// The Blelloch scan pads the bins up to the next power of two in local
+		// memory, plus one slot every 32 entries to avoid bank conflicts
+		int scan_pow2 = 1;
+		while (scan_pow2 < nr_bins) {
+			scan_pow2 *= 2;
+		}
+
 		cl::Kernel belloch3 = cl::Kernel(program, "scan_bl_local");
 		belloch3.setArg(0, buffer_B);
-		belloch3.setArg(1, buffer_C);
-		//belloch3.setArg(1, cl::Local(nr_bins * sizeof(int)));
+		belloch3.setArg(1, (fused || single_launch) ? buffer_TEMP : buffer_C);
+		belloch3.setArg(2, cl::Local((scan_pow2 + scan_pow2 / 32) * sizeof(int)));
+		belloch3.setArg(3, sizeof(cl_int), &nr_bins);
+
+		size_t belloch_local = tuned_local_size(belloch3, device);
 
 		//cerr << kernel_1.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << std::endl;
 		//cerr << device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() << std::endl;
 
 		// Declare events for profiling
+		cl::Event coarse_prof;
+		cl::Event sort_start;
+		cl::Event sort_end;
+		cl::Event compact_prof;
+		cl::Event scatter_prof;
+		int nr_entries = 0;
 		cl::Event histogram;
+		cl::Event reduce_prof;
+		cl::Event scan_start;
 		cl::Event cumulative;
 		cl::Event normalise;
 		cl::Event map;
 
 		cl::Event scan_atomic;
 		cl::Event global_hist_prof;
+		cl::Event local_hist_prof;
 		cl::Event belloch_prof;
 		
 		// Call all kernels in a sequence
-		if (bit_16) {
-			queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &histogram);
-			queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(group_size), cl::NullRange, NULL, &cumulative);
-			queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(group_size), cl::NullRange, NULL, &normalise);
-			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &map);
+		if (bit_16 && hist_method == 2) {
+			size_t coarse_local = tuned_local_size(coarse_hist, device);
+			size_t fine_local = tuned_local_size(fine_hist, device);
+
+			queue.enqueueNDRangeKernel(coarse_hist, cl::NullRange, cl::NDRange(nr_partials * coarse_local), cl::NDRange(coarse_local), NULL, &coarse_prof);
+
+			// List the occupied coarse buckets, only these are refined. The
+			// passes cover every bucket and those past the list exit early
+			int nr_passes = (nr_buckets + buckets_per_pass - 1) / buckets_per_pass;
+
+			queue.enqueueNDRangeKernel(list_buckets, cl::NullRange, cl::NDRange(list_local), cl::NDRange(list_local));
+			queue.enqueueNDRangeKernel(fine_hist, cl::NullRange, cl::NDRange(nr_partials * fine_local, nr_passes), cl::NDRange(fine_local, 1), NULL, &histogram);
+			queue.enqueueNDRangeKernel(scan_two_level, cl::NullRange, cl::NDRange(nr_buckets * scan_two_level_local), cl::NDRange(scan_two_level_local), NULL, &cumulative);
+			queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(lut_values), cl::NullRange, NULL, &normalise);
+			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(map_global), cl::NDRange(map_local), NULL, &map);
+		}
+		else if (bit_16 && hist_method == 4) {
+			size_t hash_local = tuned_local_size(hash_hist, device);
+			size_t scan_local = tuned_local_size(sparse_scan, device);
+
+			queue.enqueueNDRangeKernel(hash_hist, cl::NullRange, cl::NDRange(nr_partials * hash_local), cl::NDRange(hash_local), NULL, &histogram);
+
+			// Compact the occupied bins, the block offsets come from an
+			// exclusive scan of the per block counts
+			sparse_scan.setArg(0, buffer_BLOCKS);
+			sparse_scan.setArg(2, nr_buckets);
+
+			queue.enqueueNDRangeKernel(sparse_count, cl::NullRange, cl::NDRange(nr_buckets * count_local), cl::NDRange(count_local));
+			queue.enqueueNDRangeKernel(sparse_scan, cl::NullRange, cl::NDRange(scan_local), cl::NDRange(scan_local));
+			queue.enqueueNDRangeKernel(sparse_compact, cl::NullRange, cl::NDRange(nr_buckets * compact_local), cl::NDRange(compact_local), NULL, &compact_prof);
+			queue.enqueueReadBuffer(buffer_ENTRIES, CL_TRUE, 0, sizeof(int), &nr_entries);
+
+			// Scan and normalise only the compacted entries
+			queue.enqueueCopyBuffer(buffer_SPARSE, buffer_C, 0, 0, nr_entries * sizeof(int));
+			sparse_scan.setArg(0, buffer_C);
+			sparse_scan.setArg(2, nr_entries);
+			normalise_sparse.setArg(5, sizeof(cl_int), &nr_entries);
+			scatter_sparse.setArg(4, sizeof(cl_int), &nr_entries);
+
+			queue.enqueueNDRangeKernel(sparse_scan, cl::NullRange, cl::NDRange(scan_local), cl::NDRange(scan_local), NULL, &cumulative);
+			queue.enqueueNDRangeKernel(normalise_sparse, cl::NullRange, cl::NDRange(nr_entries), cl::NullRange, NULL, &normalise);
+			queue.enqueueNDRangeKernel(scatter_sparse, cl::NullRange, cl::NDRange(nr_entries), cl::NullRange, NULL, &scatter_prof);
+			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(map_global), cl::NDRange(map_local), NULL, &map);
+		}
+		else if (bit_16) {
+			if (hist_method == 3) {
+				size_t count_local = tuned_local_size(radix_count, device);
+				size_t scan_local = tuned_local_size(radix_scan, device);
+				size_t scatter_local = tuned_local_size(radix_scatter, device);
+
+				cl::Buffer* sort_src = &buffer_A;
+				cl::Buffer* sort_dst = &buffer_SORT_1;
+
+				for (int shift = 0; shift < 16; shift += 4) {
+					radix_count.setArg(0, *sort_src);
+					radix_count.setArg(4, shift);
+					radix_scatter.setArg(0, *sort_src);
+					radix_scatter.setArg(1, *sort_dst);
+					radix_scatter.setArg(5, shift);
+
+					// Both radix kernels must use the same number of work-groups
+					queue.enqueueNDRangeKernel(radix_count, cl::NullRange, cl::NDRange(nr_partials * count_local), cl::NDRange(count_local), NULL, shift == 0 ? &sort_start : NULL);
+					queue.enqueueNDRangeKernel(radix_scan, cl::NullRange, cl::NDRange(scan_local), cl::NDRange(scan_local));
+					queue.enqueueNDRangeKernel(radix_scatter, cl::NullRange, cl::NDRange(nr_partials * scatter_local), cl::NDRange(scatter_local), NULL, shift == 12 ? &sort_end : NULL);
+
+					sort_src = sort_dst;
+					sort_dst = (sort_dst == &buffer_SORT_1) ? &buffer_SORT_2 : &buffer_SORT_1;
+				}
+
+				queue.enqueueNDRangeKernel(sorted_hist, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &histogram);
+			}
+			else if (hist_method == 5) {
+				queue.enqueueNDRangeKernel(runs_hist, cl::NullRange, cl::NDRange(runs_global), cl::NullRange, NULL, &histogram);
+			}
+			else {
+				queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(hist_global, nr_chunks), cl::NDRange(hist_local, 1), NULL, &histogram);
+
+				if (partial) {
+					queue.enqueueNDRangeKernel(reduce, cl::NullRange, cl::NDRange(reduce_global, reduce_y), cl::NDRange(32, reduce_y), NULL, &reduce_prof);
+				}
+			}
+
+			// Multi-block scan of the dense 16-bit histogram
+			queue.enqueueNDRangeKernel(scan_blocks, cl::NullRange, cl::NDRange(nr_scan_blocks * block_size), cl::NDRange(block_size), NULL, &scan_start);
+			queue.enqueueNDRangeKernel(scan_block_sums, cl::NullRange, cl::NDRange(block_sums_local), cl::NDRange(block_sums_local));
+			queue.enqueueNDRangeKernel(scan_add_offsets, cl::NullRange, cl::NDRange(nr_scan_blocks * block_size), cl::NDRange(block_size), NULL, &cumulative);
+			queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(lut_values), cl::NullRange, NULL, &normalise);
+			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(map_global), cl::NDRange(map_local), NULL, &map);
+		}
+		else if (single_launch) {
+			queue.enqueueNDRangeKernel(single_lut, cl::NullRange, cl::NDRange(nr_partials * lut_local), cl::NDRange(lut_local), NULL, &histogram);
+			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(map_global), cl::NDRange(map_local), NULL, &map);
 		}
 		else {
-			queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(group_size), NULL, &histogram);
+			queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(hist_global), cl::NDRange(hist_local), NULL, &histogram);
 
-			if (scan_method < 1) {
-				queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &cumulative);
+			if (partial) {
+				queue.enqueueNDRangeKernel(reduce, cl::NullRange, cl::NDRange(reduce_global, reduce_y), cl::NDRange(32, reduce_y), NULL, &reduce_prof);
+			}
+
+			if (fused) {
+				queue.enqueueNDRangeKernel(scan_norm, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &cumulative);
 			}
 			else {
-				queue.enqueueNDRangeKernel(belloch3, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &cumulative);
+				queue.enqueueNDRangeKernel(belloch3, cl::NullRange, cl::NDRange(belloch_local), cl::NDRange(belloch_local), NULL, &cumulative);
+				queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(lut_values), cl::NullRange, NULL, &normalise);
 			}
-			
-			queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &normalise);
-			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(group_size), NULL, &map);
+
+			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(map_global), cl::NDRange(map_local), NULL, &map);
 		}
 		
 		map.wait(); // Wait for final kernel to finish
 		
 		cl::Event im_read_prof;
 
-		// Initialise output vectors
-		vector<unsigned short> out_16(input_elements, 0);
-		vector<unsigned char> out(input_elements, 0);
+		// The output is read back into the input image, which the host no
+		// longer needs, unless the benchmarks (-t) still use the input.
+		// 8-bit colour images come back from the device as RGB
+		CImg<unsigned char> output_store;
+		CImg<unsigned short> output_store_16;
+		CImg<unsigned char>& output_image = (benchmark && !bit_16) ? output_store.assign(width, height, depth, spectrum, 0) : image_input;
+		CImg<unsigned short>& output_image_16 = (benchmark && bit_16) ? output_store_16.assign(width, height, depth, spectrum, 0) : image_input_16;
 
-		// Copy output data from the device to the host and into the appropriate vector
+		// Copy output data from the device to the host and into the first
+		// channel of the output image (all three for colour)
 		if (bit_16) {
-			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, input_size, &out_16.data()[0], NULL, &im_read_prof);
-		}
-		else {
-			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, input_size, &out.data()[0], NULL, &im_read_prof);
-		}
-
-		// Initialise image outputs and set first channel to output data
-		CImg<unsigned char> output_image(original.width(), original.height(), original.depth(), original.spectrum());
-		output_image.get_shared_channel(0) = CImg<unsigned char>(out.data(), original.width(), original.height(), original.depth(), 1);
+			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, input_size, &output_image_16.data()[0], NULL, &im_read_prof);
 
-		CImg<unsigned short> output_image_16(original.width(), original.height(), original.depth(), original.spectrum());
-		output_image_16.get_shared_channel(0) = CImg<unsigned short>(out_16.data(), original.width(), original.height(), original.depth(), 1);
+			// 16-bit colour images take Cb and Cr from the converted input,
+			// already in place unless the output has its own buffer
+			if (spectrum == 3) {
+				unsigned short* rgb = output_image_16.data();
 
+				if (&output_image_16 != &image_input_16) {
+					memcpy(rgb + plane, image_input_16.data() + plane, 2 * input_size);
+				}
 
-		// If the input image is a colour image, add the colour
-		// channels back to the output image and convert it
-		// to an RGB image.
-		if (original.spectrum() == 3) {
-			output_image.get_shared_channel(1) = cb;
-			output_image.get_shared_channel(2) = cr;
-			
-			output_image = output_image.get_YCbCrtoRGB();
+				YCbCrtoRGB(rgb, rgb + plane, rgb + 2 * plane, rgb, rgb + plane, rgb + 2 * plane, plane);
+			}
+		}
+		else if (colour) {
+			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, 3 * input_size, &output_image.data()[0], NULL, &im_read_prof);
+		}
+		else {
+			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, input_size, &output_image.data()[0], NULL, &im_read_prof);
 		}
 
 		CImgDisplay disp_output; // Initialise output display
 
-		// Display final output image
-		if (bit_16) {
+		// Write the output image to file in headless mode, CImg picks the
+		// format from the extension (16-bit PNM for 16-bit values),
+		// otherwise display the final output image. A failed save is
+		// reported and makes the exit code nonzero
+		if (headless) {
+			try {
+				if (bit_16) {
+					output_image_16.save(output_filename.c_str());
+				}
+				else {
+					output_image.save(output_filename.c_str());
+				}
+			}
+			catch (const CImgException& err) {
+				std::cerr << "Cannot save " << output_filename << ": " << err.what() << std::endl;
+				exit_code = 1;
+			}
+		}
+		else if (bit_16) {
 			disp_output = CImgDisplay(output_image_16, "output");
 		}
 		else {
@@ -393,15 +1632,80 @@ int main(int argc, char** argv) {
 		}
 
 		// Print profiling results
-		std::cout << "Histogram: "
-			<< GetFullProfilingInfo(histogram, ProfilingResolution::PROF_US) << std::endl;
-		std::cout << "Cumulative: "
-			<< GetFullProfilingInfo(cumulative, ProfilingResolution::PROF_US) << std::endl;
-		std::cout << "Normalise: "
-			<< GetFullProfilingInfo(normalise, ProfilingResolution::PROF_US) << std::endl;
+		if (bit_16 && hist_method == 2) {
+			std::cout << "Coarse Histogram: "
+				<< GetFullProfilingInfo(coarse_prof, ProfilingResolution::PROF_US) << std::endl;
+		}
+
+		if (bit_16 && hist_method == 4) {
+			std::cout << "Compact: "
+				<< GetFullProfilingInfo(compact_prof, ProfilingResolution::PROF_US) << std::endl;
+			std::cout << "Sparse entries: " << nr_entries << std::endl;
+			std::cout << "Scatter LUT: "
+				<< GetFullProfilingInfo(scatter_prof, ProfilingResolution::PROF_US) << std::endl;
+		}
+
+		if (bit_16 && hist_method == 3) {
+			std::cout << "Radix Sort: "
+				<< GetSpanProfilingInfo(sort_start, sort_end, ProfilingResolution::PROF_US) << std::endl;
+		}
+
+		// The single-launch kernel covers the histogram, scan and normalise
+		if (single_launch) {
+			std::cout << "Histogram + LUT: "
+				<< GetFullProfilingInfo(histogram, ProfilingResolution::PROF_US) << std::endl;
+		}
+		else {
+			std::cout << "Histogram: "
+				<< GetFullProfilingInfo(histogram, ProfilingResolution::PROF_US) << std::endl;
+
+			if (partial) {
+				std::cout << "Reduce: "
+					<< GetFullProfilingInfo(reduce_prof, ProfilingResolution::PROF_US) << std::endl;
+			}
+
+			// The multi-block scan is three kernels, profiled from the start of
+			// the first to the end of the last
+			if (bit_16 && hist_method != 2 && hist_method != 4) {
+				std::cout << "Cumulative: "
+					<< GetSpanProfilingInfo(scan_start, cumulative, ProfilingResolution::PROF_US) << std::endl;
+			}
+			else if (fused) {
+				std::cout << "Scan + Normalise: "
+					<< GetFullProfilingInfo(cumulative, ProfilingResolution::PROF_US) << std::endl;
+			}
+			else {
+				std::cout << "Cumulative: "
+					<< GetFullProfilingInfo(cumulative, ProfilingResolution::PROF_US) << std::endl;
+			}
+
+			if (!fused) {
+				std::cout << "Normalise: "
+					<< GetFullProfilingInfo(normalise, ProfilingResolution::PROF_US) << std::endl;
+			}
+		}
+
 		std::cout << "Map LUT: "
 			<< GetFullProfilingInfo(map, ProfilingResolution::PROF_US) << std::endl << endl;
 
+		// The sorted pixel values give exact percentiles for free
+		if (bit_16 && hist_method == 3) {
+			int percentiles[] = { 1, 5, 25, 50, 75, 95, 99 };
+
+			std::cout << "Percentiles:";
+
+			for (int p : percentiles) {
+				unsigned short value;
+				size_t index = min(input_elements - 1, p * input_elements / 100);
+
+				queue.enqueueReadBuffer(buffer_SORT_2, CL_TRUE, index * sizeof(unsigned short), sizeof(unsigned short), &value);
+
+				std::cout << " p" << p << " = " << value;
+			}
+
+			std::cout << std::endl << endl;
+		}
+
 		std::cout << "Image Input vector write time [ns]: " <<
 			im_write_prof.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
 			im_write_prof.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
@@ -419,21 +1723,61 @@ int main(int argc, char** argv) {
 
 			queue.enqueueReadBuffer(buffer_B, CL_TRUE, 0, group_size * sizeof(int), &hist[0]);
 			queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, group_size * sizeof(int), &cum[0]);
-			queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, group_size * sizeof(int), &norm[0]);
+
+			// The sparse histogram's cumulative and LUT vectors are compact,
+			// only the first nr_entries values (for the sorted keys) are used,
+			// the compact LUT is printed rather than the scattered one
+			if (bit_16 && hist_method == 4) {
+				vector<int> keys(nr_entries);
+				vector<unsigned short> lut(nr_entries);
+
+				queue.enqueueReadBuffer(buffer_KEYS, CL_TRUE, 0, nr_entries * sizeof(int), &keys[0]);
+				queue.enqueueReadBuffer(buffer_SPARSE_LUT, CL_TRUE, 0, nr_entries * sizeof(unsigned short), &lut[0]);
+
+				cum.resize(nr_entries);
+				norm.assign(lut.begin(), lut.end());
+
+				cout << "Keys = " << keys << endl << endl;
+			}
+			// Otherwise the LUT holds an output pixel value per input value
+			else if (bit_16) {
+				vector<unsigned short> lut(lut_values);
+
+				queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, lut_size, &lut[0]);
+				norm.assign(lut.begin(), lut.end());
+			}
+			else {
+				vector<unsigned char> lut(lut_values);
+
+				queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, lut_size, &lut[0]);
+				norm.assign(lut.begin(), lut.end());
+			}
 
 			cout << "Histogram = " << hist << endl << endl;
 			cout << "Cumulative = " << cum << endl << endl;
 			cout << "LUT = " << norm << endl << endl;
 		}
 
+		// Headless runs are done once the image is written, unless
+		// benchmarks were asked for
+		if (headless && !benchmark) {
+			return exit_code;
+		}
+
 		// If image is 8-bit then run and profile the data against un-optimised
-		// and different algorithms/methods 
+		// and different algorithms/methods. The comparison histograms read
+		// single-channel pixels, buffer_A holds RGB planes for colour images
+		// so they are skipped there
 		if (!bit_16) {
-			queue.enqueueNDRangeKernel(global_hist, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &global_hist_prof);
+			if (!colour) {
+				queue.enqueueNDRangeKernel(global_hist, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &global_hist_prof);
+				queue.enqueueNDRangeKernel(local_hist, cl::NullRange, cl::NDRange(local_hist_global), cl::NDRange(local_hist_local), NULL, &local_hist_prof);
+			}
+
 			queue.enqueueNDRangeKernel(scan_add_atomic, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &scan_atomic);
 
 			if (scan_method < 1) {
-				queue.enqueueNDRangeKernel(belloch3, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &belloch_prof);
+				queue.enqueueNDRangeKernel(belloch3, cl::NullRange, cl::NDRange(belloch_local), cl::NDRange(belloch_local), NULL, &belloch_prof);
 			}
 			else {
 				queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(group_size), cl::NDRange(group_size), NULL, &belloch_prof);
@@ -443,8 +1787,14 @@ int main(int argc, char** argv) {
 
 			// Print profiling results
 			std::cout << endl << "---Other methods---" << endl;
-			std::cout << "Atomic Histogram: "
-				<< GetFullProfilingInfo(global_hist_prof, ProfilingResolution::PROF_US) << std::endl;
+
+			if (!colour) {
+				std::cout << "Atomic Histogram: "
+					<< GetFullProfilingInfo(global_hist_prof, ProfilingResolution::PROF_US) << std::endl;
+				std::cout << "Local Histogram: "
+					<< GetFullProfilingInfo(local_hist_prof, ProfilingResolution::PROF_US) << std::endl;
+			}
+
 			std::cout << "Atomic Scan: "
 				<< GetFullProfilingInfo(scan_atomic, ProfilingResolution::PROF_US) << std::endl;
 
@@ -459,8 +1809,258 @@ int main(int argc, char** argv) {
 
 		}
 
+		// 16-bit images are compared against the naive one atomic per
+		// pixel histogram and the old atomic scan. The scan is O(N^2) atomics
+		// over 65536 bins, so it only runs with -t
+		if (benchmark && bit_16) {
+			queue.enqueueNDRangeKernel(global_hist, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &global_hist_prof);
+			queue.enqueueNDRangeKernel(scan_add_atomic, cl::NullRange, cl::NDRange(group_size), cl::NullRange, NULL, &scan_atomic);
+
+			scan_atomic.wait();
+
+			std::cout << endl << "---Other methods---" << endl;
+			std::cout << "Atomic Histogram: "
+				<< GetFullProfilingInfo(global_hist_prof, ProfilingResolution::PROF_US) << std::endl;
+			std::cout << "Atomic Scan: "
+				<< GetFullProfilingInfo(scan_atomic, ProfilingResolution::PROF_US) << std::endl << endl;
+		}
+
+		// Local atomic contention benchmark, single and replicated local
+		// histograms on a constant image, where every pixel hits the same bin,
+		// and on uniform noise
+		if (benchmark && !bit_16) {
+			vector<unsigned char> constant_image(input_elements, 128);
+			vector<unsigned char> noise_image(input_elements);
+
+			for (size_t i = 0; i < input_elements; i++) {
+				noise_image[i] = rand() % 256;
+			}
+
+			cl::Buffer buffer_BENCH(context, CL_MEM_READ_ONLY, input_size);
+
+			cl::Kernel bench_single = cl::Kernel(program, "histogram_vec");
+			bench_single.setArg(0, buffer_BENCH);
+			bench_single.setArg(1, buffer_TEMP);
+			bench_single.setArg(2, cl::Local(nr_bins * sizeof(int)));
+			bench_single.setArg(3, sizeof(cl_int), &nr_bins);
+			bench_single.setArg(4, sizeof(cl_int), &input_elements);
+			bench_single.setArg(5, 0);
+
+			cl::Kernel bench_rep = cl::Kernel(program, "histogram_rep");
+			bench_rep.setArg(0, buffer_BENCH);
+			bench_rep.setArg(1, buffer_TEMP);
+			bench_rep.setArg(2, cl::Local(copies * (nr_bins + 1) * sizeof(int)));
+			bench_rep.setArg(3, sizeof(cl_int), &nr_bins);
+			bench_rep.setArg(4, sizeof(cl_int), &input_elements);
+			bench_rep.setArg(5, sizeof(cl_int), &copies);
+			bench_rep.setArg(6, 0);
+
+			size_t single_local = tuned_local_size(bench_single, device);
+			size_t rep_local = tuned_local_size(bench_rep, device);
+
+			const char* bench_names[] = { "Constant", "Noise" };
+			vector<unsigned char>* bench_images[] = { &constant_image, &noise_image };
+
+			std::cout << "---Contention benchmark---" << endl;
+
+			for (int i = 0; i < 2; i++) {
+				cl::Event single_prof;
+				cl::Event rep_prof;
+
+				queue.enqueueWriteBuffer(buffer_BENCH, CL_TRUE, 0, input_size, &bench_images[i]->data()[0]);
+				queue.enqueueNDRangeKernel(bench_single, cl::NullRange, cl::NDRange(compute_units * single_local * 4), cl::NDRange(single_local), NULL, &single_prof);
+				queue.enqueueNDRangeKernel(bench_rep, cl::NullRange, cl::NDRange(compute_units * rep_local * 4), cl::NDRange(rep_local), NULL, &rep_prof);
+
+				rep_prof.wait();
+
+				std::cout << bench_names[i] << " image, single histogram: "
+					<< GetFullProfilingInfo(single_prof, ProfilingResolution::PROF_US) << std::endl;
+				std::cout << bench_names[i] << " image, " << copies << " copies: "
+					<< GetFullProfilingInfo(rep_prof, ProfilingResolution::PROF_US) << std::endl;
+			}
+
+			std::cout << endl;
+		}
+
+		// Host colour conversion benchmark, CImg's RGBtoYCbCr/YCbCrtoRGB
+		// against the fixed-point converter writing into existing planes
+		if (benchmark && colour) {
+			CImg<unsigned char> ycbcr(image_input.width(), image_input.height(), image_input.depth(), 3);
+			CImg<unsigned char> rgb(image_input.width(), image_input.height(), image_input.depth(), 3);
+			unsigned char* src = image_input.data();
+			unsigned char* y = ycbcr.data();
+			unsigned char* dst = rgb.data();
+
+			auto cimg_start = std::chrono::high_resolution_clock::now();
+			CImg<unsigned char> cimg_ycbcr = image_input.get_RGBtoYCbCr();
+			CImg<unsigned char> cimg_rgb = cimg_ycbcr.get_YCbCrtoRGB();
+			auto cimg_end = std::chrono::high_resolution_clock::now();
+
+			ColourPath path = RGBtoYCbCr(src, src + plane, src + 2 * plane, y, y + plane, y + 2 * plane, plane);
+			YCbCrtoRGB(y, y + plane, y + 2 * plane, dst, dst + plane, dst + 2 * plane, plane);
+			auto fixed_end = std::chrono::high_resolution_clock::now();
+
+			std::cout << "---Host colour conversion benchmark---" << endl;
+			std::cout << "CImg RGB -> YCbCr -> RGB: "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(cimg_end - cimg_start).count() << " [us]" << std::endl;
+			std::cout << "Fixed-point, " << ColourPathName(path) << " (" << ColourPathLanes(path) << " pixels per step): "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(fixed_end - cimg_end).count() << " [us]" << std::endl;
+			std::cout << "Results " << (cimg_ycbcr == ycbcr && cimg_rgb == rgb ? "match" : "differ") << std::endl << endl;
+		}
+
+		// Batched scan benchmark, K copies of the histogram scanned by K
+		// separate scan_add launches against one segmented scan launch
+		if (benchmark && !bit_16) {
+			int batch_size = 64;
+			size_t batch_bytes = batch_size * nr_bins * sizeof(int);
+			vector<int> offsets(batch_size + 1);
+
+			for (int k = 0; k <= batch_size; k++) {
+				offsets[k] = k * nr_bins;
+			}
+
+			cl::Buffer buffer_BATCH(context, CL_MEM_READ_WRITE, batch_bytes);
+			cl::Buffer buffer_BATCH_SEQ(context, CL_MEM_READ_WRITE, batch_bytes);
+			cl::Buffer buffer_BATCH_SEG(context, CL_MEM_READ_WRITE, batch_bytes);
+			cl::Buffer buffer_OFFSETS(context, CL_MEM_READ_ONLY, offsets.size() * sizeof(int));
+
+			queue.enqueueWriteBuffer(buffer_OFFSETS, CL_TRUE, 0, offsets.size() * sizeof(int), &offsets[0]);
+
+			for (int k = 0; k < batch_size; k++) {
+				queue.enqueueCopyBuffer(buffer_B, buffer_BATCH, 0, k * nr_bins * sizeof(int), nr_bins * sizeof(int));
+			}
+
+			cl::Kernel bench_scan = cl::Kernel(program, "scan_add");
+			bench_scan.setArg(0, buffer_BATCH);
+			bench_scan.setArg(1, buffer_BATCH_SEQ);
+			bench_scan.setArg(2, cl::Local(nr_bins * sizeof(int)));
+			bench_scan.setArg(3, cl::Local(nr_bins * sizeof(int)));
+			bench_scan.setArg(4, sizeof(cl_int), &nr_bins);
+
+			cl::Kernel bench_segmented = cl::Kernel(program, "scan_segmented");
+			size_t segmented_local = tuned_local_size(bench_segmented, device);
+			bench_segmented.setArg(0, buffer_BATCH);
+			bench_segmented.setArg(1, buffer_BATCH_SEG);
+			bench_segmented.setArg(2, buffer_OFFSETS);
+			bench_segmented.setArg(3, cl::Local(segmented_local * sizeof(int)));
+
+			cl::Event seq_first;
+			cl::Event seq_last;
+			cl::Event segmented_prof;
+
+			// scan_add works on global ids, so each launch is offset onto its segment
+			for (int k = 0; k < batch_size; k++) {
+				queue.enqueueNDRangeKernel(bench_scan, cl::NDRange(k * nr_bins), cl::NDRange(nr_bins), cl::NDRange(nr_bins), NULL,
+					k == 0 ? &seq_first : (k == batch_size - 1 ? &seq_last : NULL));
+			}
+
+			queue.enqueueNDRangeKernel(bench_segmented, cl::NullRange, cl::NDRange(batch_size * segmented_local), cl::NDRange(segmented_local), NULL, &segmented_prof);
+
+			vector<int> seq_result(batch_size * nr_bins);
+			vector<int> seg_result(batch_size * nr_bins);
+
+			queue.enqueueReadBuffer(buffer_BATCH_SEQ, CL_TRUE, 0, batch_bytes, &seq_result[0]);
+			queue.enqueueReadBuffer(buffer_BATCH_SEG, CL_TRUE, 0, batch_bytes, &seg_result[0]);
+
+			std::cout << "---Batched scan benchmark---" << endl;
+			std::cout << batch_size << " scan_add launches: "
+				<< GetSpanProfilingInfo(seq_first, seq_last, ProfilingResolution::PROF_US) << std::endl;
+			std::cout << "Segmented scan, " << batch_size << " segments: "
+				<< GetFullProfilingInfo(segmented_prof, ProfilingResolution::PROF_US) << std::endl;
+			std::cout << "Results " << (seq_result == seg_result ? "match" : "differ") << std::endl << endl;
+		}
+
+		// Atomic traffic benchmark for 16-bit images, one atomic per pixel
+		// against the run-aggregated histogram on the input image and on a
+		// vertical gradient where every row is a single value
+		if (benchmark && bit_16) {
+			vector<unsigned short> gradient_image(input_elements);
+
+			for (size_t i = 0; i < input_elements; i++) {
+				gradient_image[i] = (i / width) * 65535 / max(1, height - 1);
+			}
+
+			cl::Buffer buffer_BENCH(context, CL_MEM_READ_ONLY, input_size);
+
+			cl::Kernel bench_atomic = cl::Kernel(program, "histogram_16");
+			bench_atomic.setArg(0, buffer_BENCH);
+			bench_atomic.setArg(1, buffer_TEMP);
+			bench_atomic.setArg(2, sizeof(cl_int), &nr_bins);
+
+			// The production kernel is timed, the counting variant runs
+			// separately and its per work-item counts are summed on the host
+			cl::Buffer buffer_RUN_ATOMICS(context, CL_MEM_READ_WRITE, runs_global * sizeof(int));
+			vector<int> run_atomics(runs_global);
+
+			cl::Kernel bench_runs = cl::Kernel(program, "histogram_16_runs");
+			bench_runs.setArg(0, buffer_BENCH);
+			bench_runs.setArg(1, buffer_TEMP);
+			bench_runs.setArg(2, sizeof(cl_int), &nr_bins);
+			bench_runs.setArg(3, sizeof(cl_int), &input_elements);
+			bench_runs.setArg(4, sizeof(cl_int), &run_length);
+
+			cl::Kernel bench_runs_count = cl::Kernel(program, "histogram_16_runs_count");
+			bench_runs_count.setArg(0, buffer_BENCH);
+			bench_runs_count.setArg(1, buffer_TEMP);
+			bench_runs_count.setArg(2, buffer_RUN_ATOMICS);
+			bench_runs_count.setArg(3, sizeof(cl_int), &nr_bins);
+			bench_runs_count.setArg(4, sizeof(cl_int), &input_elements);
+			bench_runs_count.setArg(5, sizeof(cl_int), &run_length);
+
+			const char* bench_names[] = { "Input", "Gradient" };
+			unsigned short* bench_images[] = { image_input_16.data(), gradient_image.data() };
+
+			std::cout << "---Atomic traffic benchmark---" << endl;
+
+			for (int i = 0; i < 2; i++) {
+				cl::Event atomic_prof;
+				cl::Event runs_prof;
+				long long nr_atomics = 0;
+
+				queue.enqueueWriteBuffer(buffer_BENCH, CL_TRUE, 0, input_size, bench_images[i]);
+				queue.enqueueNDRangeKernel(bench_atomic, cl::NullRange, cl::NDRange(input_elements), cl::NullRange, NULL, &atomic_prof);
+				queue.enqueueNDRangeKernel(bench_runs, cl::NullRange, cl::NDRange(runs_global), cl::NullRange, NULL, &runs_prof);
+				queue.enqueueNDRangeKernel(bench_runs_count, cl::NullRange, cl::NDRange(runs_global), cl::NullRange);
+				queue.enqueueReadBuffer(buffer_RUN_ATOMICS, CL_TRUE, 0, runs_global * sizeof(int), &run_atomics[0]);
+
+				for (int atomics : run_atomics) {
+					nr_atomics += atomics;
+				}
+
+				std::cout << bench_names[i] << " image, atomic histogram: "
+					<< GetFullProfilingInfo(atomic_prof, ProfilingResolution::PROF_US) << ", " << input_elements << " atomics" << std::endl;
+				std::cout << bench_names[i] << " image, run-aggregated: "
+					<< GetFullProfilingInfo(runs_prof, ProfilingResolution::PROF_US) << ", " << nr_atomics << " atomics ("
+					<< 100 - 100.0 * nr_atomics / input_elements << "% saved)" << std::endl;
+			}
+
+			std::cout << endl;
+		}
+
+		// Program build benchmark, a cold start compiling the kernels (from
+		// the embedded SPIR-V when the device takes it) against a warm
+		// start loading the binary cached by this run. Drivers with their
+		// own compile cache make the cold build faster than a first ever run
+		if (benchmark && !cache_dir.empty()) {
+			string build_options = program_build_options(device);
+			string cold_origin;
+			string warm_origin;
+
+			auto cold_start = std::chrono::high_resolution_clock::now();
+			build_program(context, device, build_options, "", &cold_origin);
+			auto cold_end = std::chrono::high_resolution_clock::now();
+			build_program(context, device, build_options, cache_dir, &warm_origin);
+			auto warm_end = std::chrono::high_resolution_clock::now();
+
+			std::cout << "---Program build benchmark---" << endl;
+			std::cout << "Cold (" << cold_origin << "): "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(cold_end - cold_start).count() << " [us]" << std::endl;
+			std::cout << "Warm (" << warm_origin << "): "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(warm_end - cold_end).count() << " [us]" << std::endl << endl;
+		}
+
 		// Close program on ESCAPE key 
-		while (!disp_input.is_closed() && !disp_output.is_closed()
+		while (!headless && !disp_input.is_closed() && !disp_output.is_closed()
 			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
 			disp_input.wait(1);
 			disp_output.wait(1);
@@ -470,12 +2070,14 @@ int main(int argc, char** argv) {
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
 	}
 	catch (CImgException& err) {
 		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
 	}
 
-	return 0;
+	return exit_code;
 }
 
 
@@ -1,49 +1,937 @@
+// The host builds with -D WORK_GROUP_SCAN on OpenCL 2.0 and later devices,
+// OpenCL C 3.0 only has the collectives when the device reports the feature
+#if defined(WORK_GROUP_SCAN) && (__OPENCL_C_VERSION__ < 300 || defined(__opencl_c_work_group_collective_functions))
+#define HAS_WORK_GROUP_SCAN
+#endif
+
+// Output pixel value for a cumulative count, the count is quantised to
+// nr_bins - 1 levels and rescaled to 0..max_value with integer math only
+int lut_value(int cum, int im_size, int nr_bins, int max_value) {
+	int level = (int)(((long)cum * (nr_bins - 1)) / im_size);
+
+	return (int)(((long)level * max_value) / (nr_bins - 1));
+}
+
 kernel void normaliseo(global const int* H, global int* N_H, const int im_size, local float* scratch) {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	local int* scratch_N_H;
+	local int* scratch_N_H;
+
+	scratch[lid] = H[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	float total = im_size;
+	float div = scratch[lid] / total;
+
+	scratch_N_H = scratch;
+	scratch_N_H[lid] = div*256;
+
+	N_H[id] = scratch_N_H[lid];
+}
+
+kernel void histogram(global const uchar* A, global int* H, local int* L_H, const int nr_bins, const int input_elements) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+
+	// The work-group size is independent of the bin count, so each
+	// work-item clears a strided range of bins
+	for (int i = lid; i < nr_bins; i += local_size) {
+		L_H[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Take the pixel value and use as bin index, if custom bin size
+	// adjust index accordingly. The grid is rounded up to whole
+	// work-groups so skip the work-items past the end of the image
+	if (id < input_elements) {
+		atomic_inc(&L_H[A[id] * nr_bins / 256]); // Increment bin
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Adds local bin counts to global counts
+	for (int i = lid; i < nr_bins; i += local_size) {
+		if (L_H[i]) {
+			atomic_add(&H[i], L_H[i]);
+		}
+	}
+}
+
+#define HIST_BIN(val) atomic_inc(&L_H[(val) * nr_bins / 256])
+
+// Applies BIN to each of the 16 lanes of p
+#define BIN16(BIN, p) \
+	BIN(p.s0); BIN(p.s1); BIN(p.s2); BIN(p.s3); \
+	BIN(p.s4); BIN(p.s5); BIN(p.s6); BIN(p.s7); \
+	BIN(p.s8); BIN(p.s9); BIN(p.sa); BIN(p.sb); \
+	BIN(p.sc); BIN(p.sd); BIN(p.se); BIN(p.sf)
+
+// Zeroes the first size ints of the local histogram, called by the whole
+// work-group
+void clear_local_histogram(local int* L_H, const int size) {
+	for (int i = get_local_id(0); i < size; i += get_local_size(0)) {
+		L_H[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Counts the 8-bit pixels of A into the local histogram, 16 per work-item
+// step with vload16 over a grid-stride loop, then the pixels left over
+// when the image size is not a multiple of 16
+void count_local_histogram(global const uchar* A, local int* L_H, const int nr_bins, const int input_elements) {
+	int nr_vectors = input_elements / 16;
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		uchar16 p = vload16(v, A);
+
+		BIN16(HIST_BIN, p);
+	}
+
+	for (int id = nr_vectors * 16 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		HIST_BIN(A[id]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Merges the local histogram into H, or writes it to the group's slice of
+// the partials buffer for the reduction merge
+void merge_local_histogram(global int* H, local int* L_H, const int nr_bins, const int partial) {
+	for (int i = get_local_id(0); i < nr_bins; i += get_local_size(0)) {
+		if (partial) {
+			H[get_group_id(0) * nr_bins + i] = L_H[i];
+		}
+		else if (L_H[i]) {
+			atomic_add(&H[i], L_H[i]);
+		}
+	}
+}
+
+// Coarsened histogram kernel, each work-item loads 16 pixels at a time with
+// vload16 and walks the image with a grid-stride loop so many pixels are
+// counted in local memory before the single merge into the global histogram
+kernel void histogram_vec(global const uchar* A, global int* H, local int* L_H, const int nr_bins, const int input_elements, const int partial) {
+	clear_local_histogram(L_H, nr_bins);
+	count_local_histogram(A, L_H, nr_bins, input_elements);
+	merge_local_histogram(H, L_H, nr_bins, partial);
+}
+
+// Luminance of an RGB pixel with CImg's RGBtoYCbCr coefficients, in integer
+// math (the rounding offset and the +16 are folded into one constant)
+#define RGB_TO_Y(r, g, b) clamp((66 * (r) + 129 * (g) + 25 * (b) + 4224) >> 8, 0, 255)
+
+// histogram_vec for 8-bit colour images, A holds the R, G and B planes back
+// to back as CImg stores them and the luminance is binned on the fly
+kernel void histogram_rgb(global const uchar* A, global int* H, local int* L_H, const int nr_bins, const int input_elements, const int partial) {
+	int nr_vectors = input_elements / 16;
+	global const uchar* G = A + input_elements;
+	global const uchar* B = G + input_elements;
+
+	clear_local_histogram(L_H, nr_bins);
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		int16 y = RGB_TO_Y(convert_int16(vload16(v, A)), convert_int16(vload16(v, G)), convert_int16(vload16(v, B)));
+
+		BIN16(HIST_BIN, y);
+	}
+
+	for (int id = nr_vectors * 16 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		HIST_BIN(RGB_TO_Y(A[id], G[id], B[id]));
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	merge_local_histogram(H, L_H, nr_bins, partial);
+}
+
+// Single-launch histogram equalisation for small 8-bit frames. Every
+// work-group builds its local histogram and merges it into H, then takes a
+// ticket; the last work-group to finish scans H and writes the 256 entry
+// LUT, so the histogram, scan and normalise cost one launch. L_H must hold
+// at least max(nr_bins, local size) ints and ticket must start at 0
+kernel void histogram_lut(global const uchar* A, global int* H, global int* C, global uchar* LUT, global int* ticket, local int* L_H, const int nr_bins, const int input_elements, const int write_cum) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	local int last;
+
+	clear_local_histogram(L_H, nr_bins);
+	count_local_histogram(A, L_H, nr_bins, input_elements);
+	merge_local_histogram(H, L_H, nr_bins, 0);
+
+	// The whole group must have merged before it takes a ticket
+	barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) {
+		last = (atomic_inc(ticket) == get_num_groups(0) - 1);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!last) {
+		return;
+	}
+
+	// Each work-item scans a contiguous run of bins, the run totals go
+	// through a serial exclusive scan as in scan_single_group. H is read
+	// with atomics so every other group's merge is seen
+	int sub = (nr_bins + local_size - 1) / local_size;
+	int start = min(nr_bins, lid * sub);
+	int end = min(nr_bins, start + sub);
+	int sum = 0;
+
+	for (int i = start; i < end; i++) {
+		sum += atomic_add(&H[i], 0);
+	}
+
+	L_H[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) {
+		int total = 0;
+
+		for (int i = 0; i < local_size; i++) {
+			int val = L_H[i];
+			L_H[i] = total;
+			total += val;
+		}
+
+		// Reset the ticket for the next launch
+		*ticket = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	sum = L_H[lid];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The cumulative histogram replaces the run totals in L_H
+	for (int i = start; i < end; i++) {
+		sum += atomic_add(&H[i], 0);
+		L_H[i] = sum;
+
+		if (write_cum) {
+			C[i] = sum;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < 256; i += local_size) {
+		LUT[i] = lut_value(L_H[i * nr_bins / 256], input_elements, nr_bins, 255);
+	}
+}
+
+#define REP_BIN(val) atomic_inc(&L_H[copy + (val) * nr_bins / 256])
+
+// Replicated version of histogram_vec for low-entropy images. The local memory
+// holds several copies of the histogram and each work-item counts into copy
+// lid % copies, so work-items hitting the same bin are spread across copies.
+// Copies are nr_bins + 1 apart so the same bin lands in different banks
+kernel void histogram_rep(global const uchar* A, global int* H, local int* L_H, const int nr_bins, const int input_elements, const int copies, const int partial) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int nr_vectors = input_elements / 16;
+	int stride = nr_bins + 1;
+	int copy = (lid % copies) * stride;
+
+	clear_local_histogram(L_H, copies * stride);
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		uchar16 p = vload16(v, A);
+
+		BIN16(REP_BIN, p);
+	}
+
+	for (int id = nr_vectors * 16 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		REP_BIN(A[id]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Fold the copies together before the global merge
+	for (int i = lid; i < nr_bins; i += local_size) {
+		int total = 0;
+
+		for (int c = 0; c < copies; c++) {
+			total += L_H[c * stride + i];
+		}
+
+		if (partial) {
+			H[get_group_id(0) * nr_bins + i] = total;
+		}
+		else if (total) {
+			atomic_add(&H[i], total);
+		}
+	}
+}
+
+// Histogram kernel for 16-bit images, naive approach due to large bin size
+kernel void histogram_16(global const ushort* A, global int* H, const int nr_bins) {
+	int id = get_global_id(0);
+
+	// Take the pixel value and use as bin index, if custom bin size
+	// adjust index accordingly
+	ushort bin_index = A[id] * nr_bins / 65536;
+
+	atomic_inc(&H[bin_index]); //serial operation, not very efficient!
+}
+
+// Privatised histogram kernel for 16-bit images. The bins are split into
+// chunks small enough to fit in local memory, the second NDRange dimension
+// picks the chunk and each work-group walks the image with a grid-stride loop,
+// only counting the pixels that fall inside its chunk
+kernel void histogram_16_local(global const ushort* A, global int* H, local int* L_H, const int nr_bins, const int chunk_bins, const int input_elements, const int partial) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int chunk_start = get_global_id(1) * chunk_bins;
+	int chunk_end = min(chunk_start + chunk_bins, nr_bins);
+
+	// Every work-item clears a strided range of the local bins
+	for (int i = lid; i < chunk_bins; i += local_size) {
+		L_H[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int id = get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		// Unsigned multiply so 65535 * 65536 does not overflow
+		int bin_index = A[id] * (uint)nr_bins / 65536;
+
+		if (bin_index >= chunk_start && bin_index < chunk_end) {
+			atomic_inc(&L_H[bin_index - chunk_start]);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Write the sub-histogram to this work-group's partial slice, or merge
+	// it into the global one skipping empty bins
+	for (int i = lid; i < chunk_end - chunk_start; i += local_size) {
+		if (partial) {
+			H[get_group_id(0) * nr_bins + chunk_start + i] = L_H[i];
+		}
+		else if (L_H[i]) {
+			atomic_add(&H[chunk_start + i], L_H[i]);
+		}
+	}
+}
+
+// First level of the two-level 16-bit histogram, counts the high byte of
+// each bin index into at most 256 coarse buckets in local memory
+kernel void histogram_16_coarse(global const ushort* A, global int* H, local int* L_H, const int nr_bins, const int input_elements) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int nr_buckets = (nr_bins + 255) / 256;
+
+	for (int i = lid; i < nr_buckets; i += local_size) {
+		L_H[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int id = get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		int bin_index = A[id] * (uint)nr_bins / 65536;
+
+		atomic_inc(&L_H[bin_index >> 8]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < nr_buckets; i += local_size) {
+		if (L_H[i]) {
+			atomic_add(&H[i], L_H[i]);
+		}
+	}
+}
+
+// Second level of the two-level 16-bit histogram, only the occupied coarse
+// buckets listed by compact_buckets are refined into 256 low-byte bins each. Every
+// pass (second NDRange dimension) keeps as many buckets in local memory as
+// will fit, slot_map translates a high byte to its slot in the pass
+kernel void histogram_16_fine(global const ushort* A, global int* H, global const int* buckets, global const int* nr_occupied, local int* L_H, local int* slot_map,
+	const int buckets_per_pass, const int nr_bins, const int input_elements) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int first = get_global_id(1) * buckets_per_pass;
+	int count = min(buckets_per_pass, *nr_occupied - first);
+
+	// The passes cover every bucket, those past the occupied ones have
+	// nothing to refine. The whole work-group shares the pass so this exit
+	// is uniform
+	if (count <= 0) {
+		return;
+	}
+
+	for (int i = lid; i < 256; i += local_size) {
+		slot_map[i] = -1;
+	}
+
+	for (int i = lid; i < count * 256; i += local_size) {
+		L_H[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < count; i += local_size) {
+		slot_map[buckets[first + i]] = i;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int id = get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		int bin_index = A[id] * (uint)nr_bins / 65536;
+		int slot = slot_map[bin_index >> 8];
+
+		if (slot >= 0) {
+			atomic_inc(&L_H[slot * 256 + (bin_index & 255)]);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < count * 256; i += local_size) {
+		if (L_H[i]) {
+			atomic_add(&H[buckets[first + i / 256] * 256 + i % 256], L_H[i]);
+		}
+	}
+}
+
+// Inclusive scan of one value per work-item across the work-group, for any
+// work-group size. Without the OpenCL 2.0 collectives this is a Hillis-Steele
+// scan in local memory, the scratch arrays are free again on return
+int scan_work_group(int val, local int* scratch_1, local int* scratch_2) {
+#ifdef HAS_WORK_GROUP_SCAN
+	return work_group_scan_inclusive_add(val);
+#else
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	local int* scratch_3;//used for buffer swap
+
+	scratch_1[lid] = val;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = 1; i < local_size; i *= 2) {
+		if (lid >= i) {
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		}
+		else {
+			scratch_2[lid] = scratch_1[lid];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+
+	int sum = scratch_1[lid];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return sum;
+#endif
+}
+
+// Sum of one value per work-item, returned to the whole work-group
+int reduce_work_group(int val, local int* scratch_1, local int* scratch_2) {
+#ifdef HAS_WORK_GROUP_SCAN
+	return work_group_reduce_add(val);
+#else
+	int sum = scan_work_group(val, scratch_1, scratch_2);
+
+	if (get_local_id(0) == get_local_size(0) - 1) {
+		scratch_1[0] = sum;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	sum = scratch_1[0];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return sum;
+#endif
+}
+
+// Contiguous run of a block of n values handled by one work-item, so a
+// work-group of any size covers the block in order
+#define BLOCK_RUN(n, start, end) \
+	int sub = ((n) + get_local_size(0) - 1) / get_local_size(0); \
+	int start = min((n), (int)get_local_id(0) * sub); \
+	int end = min((n), start + sub)
+
+// Lists the occupied coarse buckets in order for the fine pass, with their
+// number in nr_occupied. A single work-group scans the occupied counts of
+// each work-item's run of buckets, so the list never goes through the host
+kernel void compact_buckets(global const int* coarse, global int* buckets, global int* nr_occupied, local int* scratch_1, local int* scratch_2, const int nr_buckets) {
+	BLOCK_RUN(nr_buckets, start, end);
+	int count = 0;
+
+	for (int i = start; i < end; i++) {
+		count += (coarse[i] > 0);
+	}
+
+	int index = scan_work_group(count, scratch_1, scratch_2) - count;
+
+	for (int i = start; i < end; i++) {
+		if (coarse[i] > 0) {
+			buckets[index++] = i;
+		}
+	}
+
+	if (get_local_id(0) == get_local_size(0) - 1) {
+		*nr_occupied = index;
+	}
+}
+
+// Cumulative histogram for the two-level 16-bit histogram, one work-group per
+// coarse bucket of 256 bins. An empty bucket just repeats the total of the
+// buckets before it, so only the occupied buckets are scanned
+kernel void scan_16_two_level(global const int* H, global const int* coarse, global int* C, local int* scratch_1, local int* scratch_2, const int nr_bins) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int bucket = get_group_id(0);
+	BLOCK_RUN(256, start, end);
+	int sum = 0;
+
+	// Total of the buckets before this one, reduced from the coarse histogram
+	for (int i = lid; i < bucket; i += local_size) {
+		sum += coarse[i];
+	}
+
+	int offset = reduce_work_group(sum, scratch_1, scratch_2);
+
+	// The whole work-group shares the bucket so this exit is uniform
+	if (coarse[bucket] == 0) {
+		for (int i = start; i < end && bucket * 256 + i < nr_bins; i++) {
+			C[bucket * 256 + i] = offset;
+		}
+
+		return;
+	}
+
+	sum = 0;
+
+	for (int i = start; i < end && bucket * 256 + i < nr_bins; i++) {
+		sum += H[bucket * 256 + i];
+	}
+
+	sum = scan_work_group(sum, scratch_1, scratch_2) - sum + offset;
+
+	for (int i = start; i < end && bucket * 256 + i < nr_bins; i++) {
+		sum += H[bucket * 256 + i];
+		C[bucket * 256 + i] = sum;
+	}
+}
+
+// Sums the per-work-group histograms written by the histogram kernels when
+// partial is set. Work-items along dimension 0 take consecutive bins and
+// those along dimension 1 walk the partials, then a tree reduction in local
+// memory combines them. The order of additions is fixed so the result is
+// deterministic and no global atomics are needed
+kernel void reduce_partials(global const int* P, global int* H, local int* scratch, const int nr_bins, const int nr_partials) {
+	int bin = get_global_id(0);
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int size_x = get_local_size(0);
+	int size_y = get_local_size(1);
+	int sum = 0;
+
+	if (bin < nr_bins) {
+		for (int p = ly; p < nr_partials; p += size_y) {
+			sum += P[p * nr_bins + bin];
+		}
+	}
+
+	scratch[ly * size_x + lx] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = size_y / 2; i > 0; i /= 2) {
+		if (ly < i) {
+			scratch[ly * size_x + lx] += scratch[(ly + i) * size_x + lx];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (ly == 0 && bin < nr_bins) {
+		H[bin] = scratch[lx];
+	}
+}
+
+#define RADIX_BITS 4
+#define RADIX_DIGITS 16
+
+// Range of the input handled by one work-item in the radix sort kernels. The
+// input is split into one contiguous segment per work-group and each segment
+// into one contiguous run per work-item, so walking the runs in order keeps
+// the sort stable
+#define RADIX_RANGE(start, end) \
+	int seg = (n + get_num_groups(0) - 1) / get_num_groups(0); \
+	int sub = (seg + get_local_size(0) - 1) / get_local_size(0); \
+	int start = min(n, (int)(get_group_id(0) * seg + get_local_id(0) * sub)); \
+	int end = min(min(n, (int)((get_group_id(0) + 1) * seg)), start + sub)
+
+// Counting pass of one radix sort digit, writes the number of each digit in
+// this work-group's segment to counts[digit * groups + group] so that an
+// exclusive scan of counts gives every group's output offset for each digit
+kernel void radix_count(global const ushort* A, global int* counts, local int* L_C, const int n, const int shift) {
+	int lid = get_local_id(0);
+	RADIX_RANGE(start, end);
+
+	if (lid < RADIX_DIGITS) {
+		L_C[lid] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = start; i < end; i++) {
+		atomic_inc(&L_C[(A[i] >> shift) & (RADIX_DIGITS - 1)]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid < RADIX_DIGITS) {
+		counts[lid * get_num_groups(0) + get_group_id(0)] = L_C[lid];
+	}
+}
+
+// Exclusive scan in a single work-group, used for the radix digit counts. Each
+// work-item sums a contiguous run of the input, the run totals are scanned
+// in local memory and then added back while writing the run out
+kernel void scan_single_group(global int* A, local int* scratch, const int n) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int sub = (n + local_size - 1) / local_size;
+	int start = min(n, lid * sub);
+	int end = min(n, start + sub);
+	int sum = 0;
+
+	for (int i = start; i < end; i++) {
+		sum += A[i];
+	}
+
+	scratch[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) {
+		int total = 0;
+
+		for (int i = 0; i < local_size; i++) {
+			int val = scratch[i];
+			scratch[i] = total;
+			total += val;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	sum = scratch[lid];
+
+	for (int i = start; i < end; i++) {
+		int val = A[i];
+		A[i] = sum;
+		sum += val;
+	}
+}
+
+// Segmented scan over K histograms stored back to back in A, one work-group
+// per segment. offsets holds K + 1 entries and segment k covers offsets[k]
+// up to offsets[k + 1], so per-tile, per-channel and per-image batches of
+// any bin count go through one launch. Writes inclusive scans to B
+kernel void scan_segmented(global const int* A, global int* B, global const int* offsets, local int* scratch) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int segment = get_group_id(0);
+	int base = offsets[segment];
+	int n = offsets[segment + 1] - base;
+	int sub = (n + local_size - 1) / local_size;
+	int start = base + min(n, lid * sub);
+	int end = base + min(n, lid * sub + sub);
+	int sum = 0;
 
-	scratch[lid] = H[id];
+	for (int i = start; i < end; i++) {
+		sum += A[i];
+	}
+
+#ifdef HAS_WORK_GROUP_SCAN
+	sum = work_group_scan_exclusive_add(sum);
+#else
+	scratch[lid] = sum;
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	float total = im_size;
-	float div = scratch[lid] / total;
+	if (lid == 0) {
+		int total = 0;
 
-	scratch_N_H = scratch;
-	scratch_N_H[lid] = div*256;
+		for (int i = 0; i < local_size; i++) {
+			int val = scratch[i];
+			scratch[i] = total;
+			total += val;
+		}
+	}
 
-	N_H[id] = scratch_N_H[lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	sum = scratch[lid];
+#endif
+
+	for (int i = start; i < end; i++) {
+		sum += A[i];
+		B[i] = sum;
+	}
 }
 
-kernel void histogram(global const uchar* A, global int* H, local int* L_H, const int nr_bins) {
-	int id = get_global_id(0);
+// Scatter pass of one radix sort digit. Every work-item counts the digits of
+// its run, the work-group turns those into per work-item offsets within the
+// group's share of each digit, and the run is then written out in order
+kernel void radix_scatter(global const ushort* A, global ushort* B, global const int* offsets, local int* scratch, const int n, const int shift) {
 	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int pos[RADIX_DIGITS];
+	RADIX_RANGE(start, end);
 
-	// Take the pixel value and use as bin index, if custom bin size
-	// adjust index accordingly
-	int bin_index = A[id] * nr_bins / 256;
+	for (int d = 0; d < RADIX_DIGITS; d++) {
+		pos[d] = 0;
+	}
 
-	L_H[lid] = 0; // Set local array value to 0
+	for (int i = start; i < end; i++) {
+		pos[(A[i] >> shift) & (RADIX_DIGITS - 1)]++;
+	}
+
+	for (int d = 0; d < RADIX_DIGITS; d++) {
+		scratch[d * local_size + lid] = pos[d];
+	}
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	atomic_inc(&L_H[bin_index]); // Increment bin
+	// One work-item per digit scans that digit's counts across the group
+	if (lid < RADIX_DIGITS) {
+		int total = offsets[lid * get_num_groups(0) + get_group_id(0)];
+
+		for (int i = 0; i < local_size; i++) {
+			int val = scratch[lid * local_size + i];
+			scratch[lid * local_size + i] = total;
+			total += val;
+		}
+	}
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	atomic_add(&H[lid], L_H[lid]); // Adds local bin count to global count
+	for (int d = 0; d < RADIX_DIGITS; d++) {
+		pos[d] = scratch[d * local_size + lid];
+	}
+
+	for (int i = start; i < end; i++) {
+		ushort val = A[i];
+		B[pos[(val >> shift) & (RADIX_DIGITS - 1)]++] = val;
+	}
 }
 
-// Histogram kernel for 16-bit images, naive approach due to large bin size
-kernel void histogram_16(global const ushort* A, global int* H, const int nr_bins) {
+// Histogram from sorted pixel values. Equal bins form one run, so the
+// work-item at the end of a run adds its position and the one at the start
+// subtracts its own, two atomics per occupied bin rather than one per pixel
+kernel void histogram_sorted(global const ushort* S, global int* H, const int nr_bins, const int n) {
 	int id = get_global_id(0);
 
-	// Take the pixel value and use as bin index, if custom bin size
-	// adjust index accordingly
-	ushort bin_index = A[id] * nr_bins / 65536;
+	if (id >= n) {
+		return;
+	}
 
-	atomic_inc(&H[bin_index]); //serial operation, not very efficient!
+	int bin_index = S[id] * (uint)nr_bins / 65536;
+
+	if (id == 0 || S[id - 1] * (uint)nr_bins / 65536 != bin_index) {
+		atomic_sub(&H[bin_index], id);
+	}
+
+	if (id == n - 1 || S[id + 1] * (uint)nr_bins / 65536 != bin_index) {
+		atomic_add(&H[bin_index], id + 1);
+	}
+}
+
+// Run-aggregated 16-bit histogram for smooth images. Each work-item walks a
+// contiguous run of run_length pixels and issues a single atomic_add for each
+// stretch of consecutive pixels in the same bin. Returns the number of
+// atomics issued, which only the benchmark variant keeps
+int run_histogram(global const ushort* A, global int* H, const int nr_bins, const int input_elements, const int run_length) {
+	int start = get_global_id(0) * run_length;
+	int end = min(start + run_length, input_elements);
+	int atomics = 0;
+
+	if (start >= end) {
+		return 0;
+	}
+
+	int current = A[start] * (uint)nr_bins / 65536;
+	int count = 1;
+
+	for (int id = start + 1; id < end; id++) {
+		int bin_index = A[id] * (uint)nr_bins / 65536;
+
+		if (bin_index == current) {
+			count++;
+		}
+		else {
+			atomic_add(&H[current], count);
+			atomics++;
+			current = bin_index;
+			count = 1;
+		}
+	}
+
+	atomic_add(&H[current], count);
+
+	return atomics + 1;
+}
+
+kernel void histogram_16_runs(global const ushort* A, global int* H, const int nr_bins, const int input_elements, const int run_length) {
+	run_histogram(A, H, nr_bins, input_elements, run_length);
+}
+
+// Benchmark variant, every work-item stores its atomic count in its own slot
+// of nr_atomics so counting adds no contended atomics of its own
+kernel void histogram_16_runs_count(global const ushort* A, global int* H, global int* nr_atomics, const int nr_bins, const int input_elements, const int run_length) {
+	nr_atomics[get_global_id(0)] = run_histogram(A, H, nr_bins, input_elements, run_length);
+}
+
+#define HASH_PROBES 32
+
+// Sparse 16-bit histogram for images with few distinct values. Each
+// work-group counts into an open-addressing hash table in local memory
+// (keys start at -1) and only the occupied slots are merged into H. A pixel
+// that cannot find a slot within HASH_PROBES probes goes straight to H.
+// The merge stays dense on purpose: H's index order gives sparse_compact
+// sorted keys for the scan for free, where appending the
+// tables to a list would need a global sort of every work-group's entries
+// plus an unbounded list for probe overflows. The dense sweep costs a fixed
+// 768 KB (zero fill, sparse_count and sparse_compact over 65536 ints)
+kernel void histogram_16_hash(global const ushort* A, global int* H, local int* T_K, local int* T_C, const int table_bits, const int nr_bins, const int input_elements) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int table_size = 1 << table_bits;
+
+	for (int i = lid; i < table_size; i += local_size) {
+		T_K[i] = -1;
+		T_C[i] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int id = get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		int bin_index = A[id] * (uint)nr_bins / 65536;
+		uint slot = ((uint)bin_index * 2654435769u) >> (32 - table_bits);
+		bool inserted = false;
+
+		for (int probe = 0; probe < HASH_PROBES; probe++) {
+			int key = atomic_cmpxchg(&T_K[slot], -1, bin_index);
+
+			if (key == -1 || key == bin_index) {
+				atomic_inc(&T_C[slot]);
+				inserted = true;
+				break;
+			}
+
+			slot = (slot + 1) & (table_size - 1);
+		}
+
+		if (!inserted) {
+			atomic_inc(&H[bin_index]);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < table_size; i += local_size) {
+		if (T_K[i] != -1) {
+			atomic_add(&H[T_K[i]], T_C[i]);
+		}
+	}
+}
+
+// Counts the occupied bins in each block of 256, one work-group per block
+kernel void sparse_count(global const int* H, global int* block_counts, local int* scratch_1, local int* scratch_2, const int nr_bins) {
+	int block = get_group_id(0);
+	BLOCK_RUN(256, start, end);
+	int count = 0;
+
+	for (int i = start; i < end && block * 256 + i < nr_bins; i++) {
+		count += (H[block * 256 + i] > 0);
+	}
+
+	count = reduce_work_group(count, scratch_1, scratch_2);
+
+	if (get_local_id(0) == 0) {
+		block_counts[block] = count;
+	}
+}
+
+// Compacts the occupied bins into sorted (key, count) lists using the
+// scanned block counts as each block's output offset. The last work-group
+// also writes the number of entries
+kernel void sparse_compact(global const int* H, global const int* block_offsets, global int* keys, global int* counts, global int* nr_entries,
+	local int* scratch_1, local int* scratch_2, const int nr_bins) {
+	int block = get_group_id(0);
+	BLOCK_RUN(256, start, end);
+	int count = 0;
+
+	for (int i = start; i < end && block * 256 + i < nr_bins; i++) {
+		count += (H[block * 256 + i] > 0);
+	}
+
+	int index = block_offsets[block] + scan_work_group(count, scratch_1, scratch_2) - count;
+
+	for (int i = start; i < end && block * 256 + i < nr_bins; i++) {
+		int bin = block * 256 + i;
+
+		if (H[bin] > 0) {
+			keys[index] = bin;
+			counts[index] = H[bin];
+			index++;
+		}
+	}
+
+	if (block == get_num_groups(0) - 1 && get_local_id(0) == get_local_size(0) - 1) {
+		*nr_entries = index;
+	}
+}
+
+// Normalise for the sparse histogram, C holds the exclusive scan of the
+// compacted counts so the inclusive total adds the entry's own count back.
+// The compact LUT holds output pixel values like the dense 16-bit LUT
+kernel void normalise_sparse(global const int* counts, global const int* C, global ushort* LUT, const int im_size, const int nr_bins, const int nr_entries) {
+	int id = get_global_id(0);
+
+	if (id < nr_entries) {
+		LUT[id] = lut_value(C[id] + counts[id], im_size, nr_bins, 65535);
+	}
+}
+
+// Scatters the compact LUT into the dense 65536-entry LUT so it is applied by
+// the same kernels as the other 16-bit methods, one work-item per occupied
+// bin writing every pixel value in that bin. Values in unoccupied bins are
+// not in the image, so their entries are never read and are left as is
+kernel void scatter_sparse_lut(global const int* keys, global const ushort* compact, global ushort* LUT, const int nr_bins, const int nr_entries) {
+	int id = get_global_id(0);
+
+	if (id < nr_entries) {
+		uint bin = keys[id];
+		uint first = (bin * 65536 + nr_bins - 1) / nr_bins;
+		uint last = (bin + 1 == nr_bins) ? 65536 : ((bin + 1) * 65536 + nr_bins - 1) / nr_bins;
+
+		for (uint val = first; val < last; val++) {
+			LUT[val] = compact[id];
+		}
+	}
 }
 
 // Atomic version of the histogram kernel
@@ -60,6 +948,10 @@ kernel void scan_add(global const int* A, global int* B, local int* scratch_1, l
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
 	int N = bins;
+
+#ifdef HAS_WORK_GROUP_SCAN
+	int sum = work_group_scan_inclusive_add(A[id]);
+#else
 	local int* scratch_3;//used for buffer swap
 
 	//cache all N values from global memory to local memory
@@ -83,9 +975,112 @@ kernel void scan_add(global const int* A, global int* B, local int* scratch_1, l
 		scratch_1 = scratch_3;
 	}
 
+	int sum = scratch_1[lid];
+#endif
+
 	//copy the cache to output array
 	if (lid < bins) {
-		B[id] = scratch_1[lid];
+		B[id] = sum;
+	}
+}
+
+// Fused scan and normalise for a histogram that fits in one work-group,
+// the cumulative histogram stays in local memory and the 256 entry LUT is
+// written straight out with integer math. C is only written when write_cum is set
+kernel void scan_normalise(global const int* H, global int* C, global uchar* LUT, local int* scratch_1, local int* scratch_2, const int im_size, const int nr_bins, const int write_cum) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+#ifdef HAS_WORK_GROUP_SCAN
+	int sum = work_group_scan_inclusive_add(H[id]);
+#else
+	local int* scratch_3;//used for buffer swap
+
+	scratch_1[lid] = H[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = 1; i < nr_bins; i *= 2) {
+		if (lid >= i) {
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		}
+		else {
+			scratch_2[lid] = scratch_1[lid];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+
+	int sum = scratch_1[lid];
+#endif
+
+	if (write_cum) {
+		C[id] = sum;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	scratch_1[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < 256; i += get_local_size(0)) {
+		LUT[i] = lut_value(scratch_1[i * nr_bins / 256], im_size, nr_bins, 255);
+	}
+}
+
+// First step of the multi-block scan, every work-group does an inclusive
+// Hillis-Steele scan of one block of bins and writes the block total to sums
+kernel void scan_blocks(global const int* A, global int* B, global int* sums, local int* scratch_1, local int* scratch_2, const int n) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+#ifdef HAS_WORK_GROUP_SCAN
+	int sum = work_group_scan_inclusive_add((id < n) ? A[id] : 0);
+#else
+	local int* scratch_3;//used for buffer swap
+
+	scratch_1[lid] = (id < n) ? A[id] : 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = 1; i < local_size; i *= 2) {
+		if (lid >= i) {
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		}
+		else {
+			scratch_2[lid] = scratch_1[lid];
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+
+	int sum = scratch_1[lid];
+#endif
+
+	if (id < n) {
+		B[id] = sum;
+	}
+
+	if (lid == local_size - 1) {
+		sums[get_group_id(0)] = sum;
+	}
+}
+
+// Last step of the multi-block scan, once the block totals have been through
+// an exclusive scan each block adds the total of the blocks before it
+kernel void scan_add_offsets(global int* B, global const int* sums, const int n) {
+	int id = get_global_id(0);
+
+	if (id < n) {
+		B[id] += sums[get_group_id(0)];
 	}
 }
 
@@ -102,36 +1097,135 @@ kernel void scan_add_atomic(global int* A, global int* B) {
 
 }
 
-kernel void normalise(global const int* H, global int* N_H, const int im_size, const int nr_bins) {
+// Builds the LUT of output pixel values from the cumulative histogram, one
+// work-item per input value (256 for 8-bit), so applying it needs no math.
+// Pixel values map to bins the same way the histogram kernels bin them
+kernel void normalise(global const int* C, global uchar* LUT, const int im_size, const int nr_bins) {
 	int id = get_global_id(0);
-	float total = im_size;
 
-	if (H[id] != -1) {
-		N_H[id] = (H[id] / total) * (nr_bins - 1);
-	}
+	LUT[id] = lut_value(C[id * nr_bins / 256], im_size, nr_bins, 255);
 }
 
-kernel void apply_lut(global const uchar* I, global const int* LUT, global uchar* O, const int nr_bins) {
+// 16-bit version of normalise, one work-item per input value (65536)
+kernel void normalise_16(global const int* C, global ushort* LUT, const int im_size, const int nr_bins) {
 	int id = get_global_id(0);
-	float bins = 255;
-	float t_bins = nr_bins;
-	int index = I[id] * (t_bins / (bins));
 
-	uchar val_new = LUT[index] * (bins / (nr_bins-1));
+	LUT[id] = lut_value(C[id * (uint)nr_bins / 65536], im_size, nr_bins, 65535);
+}
+
+// Maps 16 pixels per work-item through the 8-bit LUT with a plain gather,
+// the 256 byte LUT is staged in local memory first. Grid-stride over the
+// image, the pixels left over after the last full vector go one at a time
+kernel void apply_lut(global const uchar* I, global const uchar* LUT, global uchar* O, local uchar* L_LUT, const int input_elements) {
+	int lid = get_local_id(0);
+	int nr_vectors = input_elements / 16;
+
+	for (int i = lid; i < 256; i += get_local_size(0)) {
+		L_LUT[i] = LUT[i];
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		uchar16 p = vload16(v, I);
+		uchar16 o = (uchar16)(L_LUT[p.s0], L_LUT[p.s1], L_LUT[p.s2], L_LUT[p.s3],
+			L_LUT[p.s4], L_LUT[p.s5], L_LUT[p.s6], L_LUT[p.s7],
+			L_LUT[p.s8], L_LUT[p.s9], L_LUT[p.sa], L_LUT[p.sb],
+			L_LUT[p.sc], L_LUT[p.sd], L_LUT[p.se], L_LUT[p.sf]);
+
+		vstore16(o, v, O);
+	}
 
-	O[id] = val_new;
+	for (int id = nr_vectors * 16 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		O[id] = L_LUT[I[id]];
+	}
 }
 
-kernel void apply_lut_16(global const ushort* I, global const int* LUT, global ushort* O, const int nr_bins) {
-	int id = get_global_id(0);
-	float bins = 65535;
-	float t_bins = nr_bins;
-	int index = I[id] * (t_bins / bins);
+// Applies the LUT to the luminance of an 8-bit colour image and writes RGB,
+// using CImg's RGBtoYCbCr and YCbCrtoRGB coefficients in integer math so no
+// host-side conversion is needed. I and O hold the R, G and B planes
+kernel void apply_lut_rgb(global const uchar* I, global const uchar* LUT, global uchar* O, local uchar* L_LUT, const int input_elements) {
+	int lid = get_local_id(0);
+
+	for (int i = lid; i < 256; i += get_local_size(0)) {
+		L_LUT[i] = LUT[i];
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int id = get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		int r = I[id];
+		int g = I[id + input_elements];
+		int b = I[id + 2 * input_elements];
+		int y = L_LUT[RGB_TO_Y(r, g, b)] - 16;
+		int cb = clamp((-38 * r - 74 * g + 112 * b + 32896) >> 8, 0, 255) - 128;
+		int cr = clamp((112 * r - 94 * g - 18 * b + 32896) >> 8, 0, 255) - 128;
+
+		O[id] = clamp((298 * y + 409 * cr + 128) / 256, 0, 255);
+		O[id + input_elements] = clamp((298 * y - 100 * cb - 208 * cr + 128) / 256, 0, 255);
+		O[id + 2 * input_elements] = clamp((298 * y + 516 * cb + 128) / 256, 0, 255);
+	}
+}
+
+// The 16-bit LUT is gathered 8 pixels at a time, LOOKUP maps one pixel
+// value through whichever memory the LUT was placed in
+#define LUT_GLOBAL(val) LUT[val]
+#define GATHER8(LOOKUP, p) (ushort8)(LOOKUP(p.s0), LOOKUP(p.s1), LOOKUP(p.s2), LOOKUP(p.s3), \
+	LOOKUP(p.s4), LOOKUP(p.s5), LOOKUP(p.s6), LOOKUP(p.s7))
+
+// Maps 8 pixels per work-item through the 128 KB ushort LUT in global
+// memory, grid-stride over the image with the leftover pixels one at a time
+kernel void apply_lut_16(global const ushort* I, global const ushort* LUT, global ushort* O, const int input_elements) {
+	int nr_vectors = input_elements / 8;
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		ushort8 p = vload8(v, I);
+
+		vstore8(GATHER8(LUT_GLOBAL, p), v, O);
+	}
+
+	for (int id = nr_vectors * 8 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		O[id] = LUT_GLOBAL(I[id]);
+	}
+}
+
+// apply_lut_16 with the LUT in constant memory, for devices whose constant
+// buffer can hold all 128 KB
+kernel void apply_lut_16_const(global const ushort* I, constant ushort* LUT, global ushort* O, const int input_elements) {
+	int nr_vectors = input_elements / 8;
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		ushort8 p = vload8(v, I);
+
+		vstore8(GATHER8(LUT_GLOBAL, p), v, O);
+	}
+
+	for (int id = nr_vectors * 8 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		O[id] = LUT_GLOBAL(I[id]);
+	}
+}
+
+// apply_lut_16 with the LUT read through a 1D image buffer (CL_R, 16-bit
+// unsigned) over the LUT buffer, so lookups go through the texture cache.
+// Only built for devices with images so the rest of the program still
+// builds on devices without them
+#ifdef __IMAGE_SUPPORT__
+#define LUT_IMAGE(val) (ushort)read_imageui(LUT, (int)(val)).x
+
+kernel void apply_lut_16_image(global const ushort* I, read_only image1d_buffer_t LUT, global ushort* O, const int input_elements) {
+	int nr_vectors = input_elements / 8;
+
+	for (int v = get_global_id(0); v < nr_vectors; v += get_global_size(0)) {
+		ushort8 p = vload8(v, I);
 
-	ushort val_new = LUT[index] * (bins / (nr_bins - 1));
+		vstore8(GATHER8(LUT_IMAGE, p), v, O);
+	}
 
-	O[id] = val_new;
+	for (int id = nr_vectors * 8 + get_global_id(0); id < input_elements; id += get_global_size(0)) {
+		O[id] = LUT_IMAGE(I[id]);
+	}
 }
+#endif
 
 kernel void scan_bl(global int* A) {
 	int id = get_global_id(0);
@@ -166,48 +1260,72 @@ kernel void scan_bl(global int* A) {
 	barrier(CLK_GLOBAL_MEM_FENCE);
 }
 
-kernel void scan_bl_local(global int* A, global int* B) {
-	int id = get_global_id(0);
-	int N = get_global_size(0);
-	local int lA[2048];
+// Local memory is padded with one extra slot every 32 entries so the
+// strided up-sweep and down-sweep accesses fall in different banks
+#define LOG_NUM_BANKS 5
+#define BANK_OFFSET(n) ((n) >> LOG_NUM_BANKS)
+
+// Work-efficient Blelloch scan in a single work-group, the bins are padded
+// with zeros up to the next power of two inside local memory so any bin count
+// works, and each work-item strides over as many tree nodes as needed.
+// The exclusive result is turned into an inclusive one on the way out so it
+// can be used in place of scan_add
+kernel void scan_bl_local(global const int* A, global int* B, local int* scratch, const int n) {
+	int lid = get_local_id(0);
+	int local_size = get_local_size(0);
+	int m = 1;
+
+	while (m < n) {
+		m *= 2;
+	}
 
-	lA[id] = A[id];
+	for (int i = lid; i < m; i += local_size) {
+		scratch[i + BANK_OFFSET(i)] = (i < n) ? A[i] : 0;
+	}
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
 	// Up-sweep phase
-	for (int stride = 1; stride < N; stride *= 2) {
-		int idx = (id + 1) * stride * 2 - 1;
-		if (idx < N) {
-			lA[idx] += lA[idx - stride];
+	int stride = 1;
+
+	for (int d = m / 2; d > 0; d /= 2) {
+		for (int i = lid; i < d; i += local_size) {
+			int ai = stride * (2 * i + 1) - 1;
+			int bi = stride * (2 * i + 2) - 1;
+
+			scratch[bi + BANK_OFFSET(bi)] += scratch[ai + BANK_OFFSET(ai)];
 		}
+
+		stride *= 2;
+
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	// Down-sweep phase
-	if (id == 0) {
-		lA[N - 1] = 0;
+	if (lid == 0) {
+		scratch[m - 1 + BANK_OFFSET(m - 1)] = 0;
 	}
 
-	//printf("%d, %d\n", id, A[id]);
-
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// Downsweep
-	for (int stride = N / 2; stride > 0; stride /= 2) {
-		barrier(CLK_LOCAL_MEM_FENCE);
-		int idx = 2 * (id + 1) * stride - 1;
-		if (idx < N) {
-			int temp = lA[idx - stride];
-			lA[idx - stride] = lA[idx];
-			lA[idx] += temp;
+	// Down-sweep phase
+	for (int d = 1; d < m; d *= 2) {
+		stride /= 2;
+
+		for (int i = lid; i < d; i += local_size) {
+			int ai = stride * (2 * i + 1) - 1;
+			int bi = stride * (2 * i + 2) - 1;
+			int temp = scratch[ai + BANK_OFFSET(ai)];
+
+			scratch[ai + BANK_OFFSET(ai)] = scratch[bi + BANK_OFFSET(bi)];
+			scratch[bi + BANK_OFFSET(bi)] += temp;
 		}
-	}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
 
-	B[id] = lA[id];
-	//printf("%d, %d\n", id, A[id]);
+	for (int i = lid; i < n; i += local_size) {
+		B[i] = scratch[i + BANK_OFFSET(i)] + A[i];
+	}
 }
 
 kernel void blelloch_scan(global const int* input, global int* output, local int* local_data, const int n)
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define COLOUR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define COLOUR_TARGET(isa)
+#else
+#include <cpuid.h>
+#define COLOUR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Fixed-point RGB <-> YCbCr conversion for planar images on the host, with the
+// coefficients CImg's RGBtoYCbCr and YCbCrtoRGB use. The planes are caller
+// provided so nothing is allocated, and the output planes may be the input
+// planes. 16-bit channels scale CImg's 8-bit offsets by 256.
+// The AVX2 (8 pixels) and SSE4.1 (4 pixels) loops are compiled for their own
+// instruction set only, and the one to run is picked from CPUID on first use,
+// so the program itself does not need /arch and still runs on older CPUs. A
+// scalar loop handles the last few pixels and CPUs with neither.
+
+template <typename T> struct ColourDepth;
+template <> struct ColourDepth<unsigned char> { static const int shift = 0; };
+template <> struct ColourDepth<unsigned short> { static const int shift = 8; };
+
+enum ColourPath { COLOUR_SCALAR, COLOUR_SSE41, COLOUR_AVX2 };
+
+inline const char* ColourPathName(ColourPath path) {
+	switch (path) {
+	case COLOUR_AVX2: return "AVX2";
+	case COLOUR_SSE41: return "SSE4.1";
+	default: return "scalar";
+	}
+}
+
+inline size_t ColourPathLanes(ColourPath path) {
+	switch (path) {
+	case COLOUR_AVX2: return 8;
+	case COLOUR_SSE41: return 4;
+	default: return 1;
+	}
+}
+
+#ifdef COLOUR_X86
+inline void ColourCpuId(int leaf, int sub_leaf, int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, sub_leaf);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, sub_leaf, a, b, c, d);
+	regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+#endif
+}
+
+// XCR0, which says which register state the OS saves on a context switch
+inline unsigned long long ColourXgetbv() {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+// SSE4.1 is CPUID.1:ECX bit 19. AVX2 is CPUID.7:EBX bit 5, and also needs AVX
+// (CPUID.1:ECX bit 28) with the OS saving the XMM and YMM state (OSXSAVE,
+// bit 27, and XCR0 bits 1-2)
+inline ColourPath DetectColourPath() {
+#ifdef COLOUR_X86
+	int regs[4];
+	ColourCpuId(0, 0, regs);
+	int max_leaf = regs[0];
+
+	if (max_leaf < 1)
+		return COLOUR_SCALAR;
+
+	ColourCpuId(1, 0, regs);
+	bool sse41 = (regs[2] >> 19) & 1;
+	bool avx = ((regs[2] >> 28) & 1) && ((regs[2] >> 27) & 1) && (ColourXgetbv() & 0x6) == 0x6;
+
+	if (avx && max_leaf >= 7) {
+		ColourCpuId(7, 0, regs);
+
+		if ((regs[1] >> 5) & 1)
+			return COLOUR_AVX2;
+	}
+
+	if (sse41)
+		return COLOUR_SSE41;
+#endif
+	return COLOUR_SCALAR;
+}
+
+inline ColourPath ActiveColourPath() {
+	static const ColourPath path = DetectColourPath();
+
+	return path;
+}
+
+// Offsets of the fixed-point sums, including the +128 rounding term, for a
+// channel depth (shift 0 for 8-bit, 8 for 16-bit)
+inline int OffsetY(int shift) { return 128 + (16 << (shift + 8)); }
+inline int OffsetC(int shift) { return 128 + (128 << (shift + 8)); }
+inline int OffsetR(int shift) { return 128 - 298 * (16 << shift) - 409 * (128 << shift); }
+inline int OffsetG(int shift) { return 128 - 298 * (16 << shift) + 308 * (128 << shift); }
+inline int OffsetB(int shift) { return 128 - 298 * (16 << shift) - 516 * (128 << shift); }
+
+template <typename T>
+inline T ClampChannel(int val) {
+	int max_val = (1 << (8 * sizeof(T))) - 1;
+
+	return (T)std::min(std::max(val, 0), max_val);
+}
+
+inline int Dot3(int a, int ca, int b, int cb, int c, int cc, int offset) {
+	return (a * ca + b * cb + c * cc + offset) >> 8;
+}
+
+#ifdef COLOUR_X86
+// AVX2, 8 pixels per step
+COLOUR_TARGET("avx2") inline __m256i LoadLanes8(const unsigned char* p) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)); }
+COLOUR_TARGET("avx2") inline __m256i LoadLanes8(const unsigned short* p) { return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)); }
+
+// Packing saturates to the channel range, so no separate clamp is needed
+COLOUR_TARGET("avx2") inline void StoreLanes8(unsigned short* p, __m256i v) {
+	__m128i v16 = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0xD8));
+	_mm_storeu_si128((__m128i*)p, v16);
+}
+
+COLOUR_TARGET("avx2") inline void StoreLanes8(unsigned char* p, __m256i v) {
+	__m128i v16 = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0xD8));
+	_mm_storel_epi64((__m128i*)p, _mm_packus_epi16(v16, v16));
+}
+
+COLOUR_TARGET("avx2") inline __m256i Dot3x8(__m256i a, int ca, __m256i b, int cb, __m256i c, int cc, int offset) {
+	__m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(a, _mm256_set1_epi32(ca)), _mm256_mullo_epi32(b, _mm256_set1_epi32(cb)));
+	sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(c, _mm256_set1_epi32(cc)));
+
+	return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(offset)), 8);
+}
+
+// SSE4.1, 4 pixels per step
+COLOUR_TARGET("sse4.1") inline __m128i LoadLanes4(const unsigned char* p) {
+	int bytes;
+	memcpy(&bytes, p, sizeof(int));
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+}
+
+COLOUR_TARGET("sse4.1") inline __m128i LoadLanes4(const unsigned short* p) { return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)p)); }
+
+COLOUR_TARGET("sse4.1") inline void StoreLanes4(unsigned short* p, __m128i v) { _mm_storel_epi64((__m128i*)p, _mm_packus_epi32(v, v)); }
+
+COLOUR_TARGET("sse4.1") inline void StoreLanes4(unsigned char* p, __m128i v) {
+	__m128i v16 = _mm_packus_epi32(v, v);
+	int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(v16, v16));
+	memcpy(p, &bytes, sizeof(int));
+}
+
+COLOUR_TARGET("sse4.1") inline __m128i Dot3x4(__m128i a, int ca, __m128i b, int cb, __m128i c, int cc, int offset) {
+	__m128i sum = _mm_add_epi32(_mm_mullo_epi32(a, _mm_set1_epi32(ca)), _mm_mullo_epi32(b, _mm_set1_epi32(cb)));
+	sum = _mm_add_epi32(sum, _mm_mullo_epi32(c, _mm_set1_epi32(cc)));
+
+	return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(offset)), 8);
+}
+
+// Vector loops, each returns how many pixels it converted
+template <typename T>
+COLOUR_TARGET("avx2") size_t RGBtoYCbCrAVX2(const T* r, const T* g, const T* b, T* y, T* cb, T* cr, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i vr = LoadLanes8(r + i), vg = LoadLanes8(g + i), vb = LoadLanes8(b + i);
+
+		StoreLanes8(y + i, Dot3x8(vr, 66, vg, 129, vb, 25, OffsetY(shift)));
+		StoreLanes8(cb + i, Dot3x8(vr, -38, vg, -74, vb, 112, OffsetC(shift)));
+		StoreLanes8(cr + i, Dot3x8(vr, 112, vg, -94, vb, -18, OffsetC(shift)));
+	}
+
+	return i;
+}
+
+template <typename T>
+COLOUR_TARGET("sse4.1") size_t RGBtoYCbCrSSE41(const T* r, const T* g, const T* b, T* y, T* cb, T* cr, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i vr = LoadLanes4(r + i), vg = LoadLanes4(g + i), vb = LoadLanes4(b + i);
+
+		StoreLanes4(y + i, Dot3x4(vr, 66, vg, 129, vb, 25, OffsetY(shift)));
+		StoreLanes4(cb + i, Dot3x4(vr, -38, vg, -74, vb, 112, OffsetC(shift)));
+		StoreLanes4(cr + i, Dot3x4(vr, 112, vg, -94, vb, -18, OffsetC(shift)));
+	}
+
+	return i;
+}
+
+template <typename T>
+COLOUR_TARGET("avx2") size_t YCbCrtoRGBAVX2(const T* y, const T* cb, const T* cr, T* r, T* g, T* b, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i vy = LoadLanes8(y + i), vcb = LoadLanes8(cb + i), vcr = LoadLanes8(cr + i);
+
+		StoreLanes8(r + i, Dot3x8(vy, 298, vcb, 0, vcr, 409, OffsetR(shift)));
+		StoreLanes8(g + i, Dot3x8(vy, 298, vcb, -100, vcr, -208, OffsetG(shift)));
+		StoreLanes8(b + i, Dot3x8(vy, 298, vcb, 516, vcr, 0, OffsetB(shift)));
+	}
+
+	return i;
+}
+
+template <typename T>
+COLOUR_TARGET("sse4.1") size_t YCbCrtoRGBSSE41(const T* y, const T* cb, const T* cr, T* r, T* g, T* b, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i vy = LoadLanes4(y + i), vcb = LoadLanes4(cb + i), vcr = LoadLanes4(cr + i);
+
+		StoreLanes4(r + i, Dot3x4(vy, 298, vcb, 0, vcr, 409, OffsetR(shift)));
+		StoreLanes4(g + i, Dot3x4(vy, 298, vcb, -100, vcr, -208, OffsetG(shift)));
+		StoreLanes4(b + i, Dot3x4(vy, 298, vcb, 516, vcr, 0, OffsetB(shift)));
+	}
+
+	return i;
+}
+#endif
+
+// Both return the path that converted the pixels, scalar when there were
+// too few for a vector step
+template <typename T>
+ColourPath RGBtoYCbCr(const T* r, const T* g, const T* b, T* y, T* cb, T* cr, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	ColourPath path = ActiveColourPath();
+	size_t i = 0;
+
+#ifdef COLOUR_X86
+	if (path == COLOUR_AVX2)
+		i = RGBtoYCbCrAVX2(r, g, b, y, cb, cr, n);
+	else if (path == COLOUR_SSE41)
+		i = RGBtoYCbCrSSE41(r, g, b, y, cb, cr, n);
+#endif
+
+	if (i == 0)
+		path = COLOUR_SCALAR;
+
+	for (; i < n; i++) {
+		int vr = r[i], vg = g[i], vb = b[i];
+
+		y[i] = ClampChannel<T>(Dot3(vr, 66, vg, 129, vb, 25, OffsetY(shift)));
+		cb[i] = ClampChannel<T>(Dot3(vr, -38, vg, -74, vb, 112, OffsetC(shift)));
+		cr[i] = ClampChannel<T>(Dot3(vr, 112, vg, -94, vb, -18, OffsetC(shift)));
+	}
+
+	return path;
+}
+
+template <typename T>
+ColourPath YCbCrtoRGB(const T* y, const T* cb, const T* cr, T* r, T* g, T* b, size_t n) {
+	int shift = ColourDepth<T>::shift;
+	ColourPath path = ActiveColourPath();
+	size_t i = 0;
+
+#ifdef COLOUR_X86
+	if (path == COLOUR_AVX2)
+		i = YCbCrtoRGBAVX2(y, cb, cr, r, g, b, n);
+	else if (path == COLOUR_SSE41)
+		i = YCbCrtoRGBSSE41(y, cb, cr, r, g, b, n);
+#endif
+
+	if (i == 0)
+		path = COLOUR_SCALAR;
+
+	for (; i < n; i++) {
+		int vy = y[i], vcb = cb[i], vcr = cr[i];
+
+		r[i] = ClampChannel<T>(Dot3(vy, 298, vcb, 0, vcr, 409, OffsetR(shift)));
+		g[i] = ClampChannel<T>(Dot3(vy, 298, vcb, -100, vcr, -208, OffsetG(shift)));
+		b[i] = ClampChannel<T>(Dot3(vy, 298, vcb, 516, vcr, 0, OffsetB(shift)));
+	}
+
+	return path;
+}
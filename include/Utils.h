@@ -4,10 +4,23 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <cstdint>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
+// The host API version can be raised from the build, e.g.
+// /D CL_HPP_TARGET_OPENCL_VERSION=200, and defaults to OpenCL 1.2
+#ifndef CL_HPP_TARGET_OPENCL_VERSION
 #define CL_HPP_TARGET_OPENCL_VERSION 120
+#endif
 #define CL_HPP_ENABLE_EXCEPTIONS
 
 #include <CL/cl2.hpp>
@@ -121,11 +134,143 @@ void CheckError(cl_int error) {
 	}
 }
 
+// OpenCL version of a device as major * 100 + minor * 10, parsed from its
+// "OpenCL <major>.<minor> <vendor-specific information>" version string
+int GetDeviceVersion(const cl::Device& device) {
+	string version = device.getInfo<CL_DEVICE_VERSION>();
+	int major = 1, minor = 2;
+	char dot;
+
+	if (version.compare(0, 7, "OpenCL ") == 0) {
+		stringstream sstream(version.substr(7));
+		sstream >> major >> dot >> minor;
+	}
+
+	return major * 100 + minor * 10;
+}
+
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
 	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+
+	if (!file) {
+		cerr << "Kernel source " << file_name << " not found" << endl;
+		exit(1);
+	}
+
+	sources.push_back(string(istreambuf_iterator<char>(file), istreambuf_iterator<char>()));
+}
+
+// SPIR-V programs through cl_khr_il_program, the OpenCL 1.2 headers do
+// not declare clCreateProgramWithIL so the extension entry point is used
+typedef cl_program(CL_API_CALL* CreateProgramWithILKHR)(cl_context, const void*, size_t, cl_int*);
+
+bool DeviceSupportsIL(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_il_program") != string::npos;
+}
+
+cl::Program CreateProgramWithIL(const cl::Context& context, const cl::Device& device, const void* il, size_t length) {
+	cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+	CreateProgramWithILKHR create = (CreateProgramWithILKHR)clGetExtensionFunctionAddressForPlatform(platform, "clCreateProgramWithILKHR");
+
+	if (create == NULL) {
+		throw cl::Error(CL_INVALID_OPERATION, "clCreateProgramWithILKHR");
+	}
+
+	cl_int error = CL_SUCCESS;
+	cl_program program = create(context(), il, length, &error);
+
+	if (error != CL_SUCCESS) {
+		throw cl::Error(error, "clCreateProgramWithILKHR");
+	}
+
+	return cl::Program(program);
+}
+
+// 64-bit FNV-1a hash, stable across runs and compilers unlike std::hash
+uint64_t HashString(const string& text, uint64_t hash = 14695981039346656037ULL) {
+	for (unsigned char c : text) {
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// Key of a cached program binary, it changes with the kernel source, the
+// build options, the platform, the device and the driver version
+string ProgramCacheKey(const cl::Program::Sources& sources, const string& build_options, const cl::Device& device) {
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+	uint64_t hash = HashString(build_options);
+
+	for (const string& source : sources) {
+		hash = HashString(source, hash);
+	}
+
+	hash = HashString(platform.getInfo<CL_PLATFORM_NAME>(), hash);
+	hash = HashString(device.getInfo<CL_DEVICE_NAME>(), hash);
+	hash = HashString(device.getInfo<CL_DEVICE_VERSION>(), hash);
+	hash = HashString(device.getInfo<CL_DRIVER_VERSION>(), hash);
+
+	stringstream sstream;
+	sstream << hex << setw(16) << setfill('0') << hash;
+
+	return sstream.str();
+}
+
+// Read a program binary for a single device, false if there is none
+bool LoadProgramBinary(const string& file_name, cl::Program::Binaries& binaries) {
+	ifstream file(file_name, ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	vector<unsigned char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	if (binary.empty()) {
+		return false;
+	}
+
+	binaries.assign(1, binary);
+
+	return true;
+}
+
+int CurrentProcessId() {
+#ifdef _WIN32
+	return _getpid();
+#else
+	return getpid();
+#endif
+}
+
+// Write the binary of a program built for a single device, through a
+// temporary file named after the process so concurrent runs never write
+// the same file and another run never reads half a binary. rename replaces
+// the old binary atomically on POSIX, Windows needs it removed first
+void SaveProgramBinary(const string& file_name, const cl::Program& program) {
+	vector<vector<unsigned char>> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+
+	if (binaries.empty() || binaries[0].empty()) {
+		return;
+	}
+
+	string temp_name = file_name + "." + to_string(CurrentProcessId()) + ".tmp";
+	ofstream file(temp_name, ios::binary);
+
+	file.write((const char*)binaries[0].data(), binaries[0].size());
+	file.close();
+
+	if (file) {
+#ifdef _WIN32
+		remove(file_name.c_str());
+#endif
+		if (rename(temp_name.c_str(), file_name.c_str()) != 0) {
+			remove(temp_name.c_str());
+		}
+	}
+	else {
+		remove(temp_name.c_str());
+	}
 }
 
 string ListPlatformsDevices() {
@@ -221,5 +366,24 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 	default: break;
 	}
 
+	return sstream.str();
+}
+
+string GetSpanProfilingInfo(const cl::Event& first, const cl::Event& last, ProfilingResolution resolution) {
+	stringstream sstream;
+
+	sstream << "Queued " << (first.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - first.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+	sstream << ", Submitted " << (first.getProfilingInfo<CL_PROFILING_COMMAND_START>() - first.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()) / resolution;
+	sstream << ", Executed " << (last.getProfilingInfo<CL_PROFILING_COMMAND_END>() - first.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / resolution;
+	sstream << ", Total " << (last.getProfilingInfo<CL_PROFILING_COMMAND_END>() - first.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+
+	switch (resolution) {
+	case PROF_NS: sstream << " [ns]"; break;
+	case PROF_US: sstream << " [us]"; break;
+	case PROF_MS: sstream << " [ms]"; break;
+	case PROF_S: sstream << " [s]"; break;
+	default: break;
+	}
+
 	return sstream.str();
 }
\ No newline at end of file